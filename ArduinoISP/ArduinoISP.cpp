@@ -43,14 +43,76 @@
 // - The SPI functions herein were developed for the AVR910_ARD programmer 
 // - More information at http://code.google.com/p/mega-isp
 
+#include <avr/eeprom.h>
 #include "pins_arduino.h"
 #include "SPI.h"
 
+// Lean build for programmers hosted on small parts (ATtiny4313): a single
+// page buffer holds a page of the TARGET_PROFILE part, the serial line is
+// the core's and ISP is bit-banged, the SPI peripheral is not used. The
+// STK500v2 engine, the counters, the vendor commands and the faster serial
+// rates are left out.
+#define LEAN			0
+
+#if LEAN && defined(__AVR_ATtiny4313__)
+// ATTinyCore numbering: ISP on the host's own ISP pins PB4-PB7, the LEDs on
+// PB0-PB2, the USART on PD0/PD1
+#define RESET			13
+#define ISP_MOSI		14
+#define ISP_MISO		15
+#define ISP_SCK			16
+#define LED_HEARTBEAT	11
+#define LED_ERROR		10
+#define LED_PROGRAMMING	9
+#elif LEAN && (defined(__AVR_ATtiny2313__) || defined(__AVR_ATtiny2313A__))
+#error an ATtiny2313 has 128 bytes of SRAM, not enough for a page buffer
+#elif LEAN && defined(__AVR_ATtiny85__)
+#error an ATtiny85 has 5 I/O pins, the serial line and ISP take 6
+#else
 #define RESET     SS
-
+#define ISP_MOSI		MOSI
+#define ISP_MISO		MISO
+#define ISP_SCK			SCK
 #define LED_HEARTBEAT	9
 #define LED_ERROR		8
 #define LED_PROGRAMMING	7
+#endif
+#define LED_PAGES		4 // LED_PROGRAMMING toggles once per this many pages
+
+// Standalone mode: an image kept in a SPI NOR flash (W25Qxx, AT25 ...) is
+// burnt into the target on a button press or VND_BURN. The store has its
+// pins of its own, a target in programming mode would take any traffic on
+// MOSI/SCK as ISP instructions.
+#define STANDALONE		0
+#define BUTTON			2
+#define BUTTON_DEBOUNCE	50 // ms the button has to hold a level for it to count
+#define STORE_CS		A0
+#define STORE_SCK		A1
+#define STORE_MOSI		A2
+#define STORE_MISO		A3
+
+// Gang programming: up to 8 targets share MOSI and SCK, each one has its own
+// RESET and MISO line. Writes go to all of them at once, whatever is read
+// back is compared against the first target in programming mode and the
+// boards which differ are reported in PARM_GANG_FAIL. An Uno has pins for
+// 4, more targets need more pins in the tables (a Mega has plenty).
+#define GANG_TARGETS	1
+#if GANG_TARGETS > 1
+static const uint8_t _gang_reset_pins[] =
+{ RESET, 3, 4, 5 };
+static const uint8_t _gang_miso_pins[] =
+{ ISP_MISO, 6, A4, A5 };
+static_assert(GANG_TARGETS <= 8, "the target masks are 8 bits");
+static_assert(GANG_TARGETS <= sizeof(_gang_reset_pins)
+		&& GANG_TARGETS <= sizeof(_gang_miso_pins),
+		"a RESET and a MISO pin are needed for every gang target");
+#endif
+
+// drive the LEDs from the timer 0 compare interrupt rather than loop()
+#define LED_TIMER		(!LEAN)
+
+// keep the flash pages STK_READ_PAGE reads and read the next one ahead
+#define READ_CACHE		(!LEAN)
 
 #define HARDWARE_VERSION	2
 #define FIRMWARE_MAJOR_VERSION	1
@@ -60,39 +122,489 @@
 #define STK_OK      0x10
 #define STK_FAILED  0x11
 #define STK_UNKNOWN 0x12
+#define STK_NODEVICE 0x13
 #define STK_INSYNC  0x14
 #define STK_NOSYNC  0x15
 #define CRC_EOP     0x20
 
+// vendor commands, outside the STK500v1 command range
+#define VND_CHECKSUM 0xE0 // len(2) memtype crc(2): CRC-16 of a block
+#define VND_STORE_ERASE 0xE1 // erase the image store
+#define VND_STORE_WRITE 0xE2 // offset(4) len(2) data: write to the store
+#define VND_STORE_READ 0xE3 // offset(4) len(2): read from the store
+#define VND_BURN 0xE4 // burn the stored image into the target
+#define VND_STREAM_WRITE 0xE5 // memtype count(2) len(2): pages back to back
+#define VND_DUMP 0xE6 // memtype len(4): read a whole region
+#define VND_STATS 0xE7 // clear: session counters, cleared if clear is set
+#define VND_BATCH 0xE8 // count flags instructions(4 * count): run them all
+#define VND_PACKED_WRITE 0xE9 // memtype len(2) plen(2) data: PackBits page
+#define VND_RESUME 0xEA // where an interrupted session may carry on
+#define VND_JOB 0xEB // len(2) (target count instructions(4 * count))...
+#define VND_SERIAL_NUMBER 0xEC // memtype address(4) width number(4)
+#define VND_INJECT 0xED // len data: the serial number, or data, per board
+#define BATCH_POLL 0x01 // flags: wait for the target after writes
+#define RESUME_PROGRAMMING 0x01 // VND_RESUME state: in programming mode
+#define RESUME_ERASED 0x02 // VND_RESUME state: chip erased
+
+// VND_STREAM_WRITE flow control: the host may send one page for each
+// STREAM_CREDIT, STREAM_WINDOW of them come right after STK_INSYNC. A page
+// in flight has to fit the receive buffer while the programmer waits for
+// the target, the core's 64 bytes only leave room for the one page.
+#define STREAM_CREDIT '+'
+#define STREAM_WINDOW (UART_RING ? 2 : 1)
+
+// STK500v2 framing, a message starting with MESSAGE_START is handled by the
+// v2 engine, so either protocol may be used from start-up on
+#define STK500V2 (!LEAN)
+#define MESSAGE_START 0x1B
+#define TOKEN 0x0E
+
+// STK parameters
+#define PARM_SCK_DURATION 0x89
+#define STK500_XTAL 7372800UL // SCK duration is counted in 8 cycles of this
+#define PARM_BAUD 0xA0 // vendor: index into the rates, see BAUD_RATE
+#define PARM_GANG_SELECT 0xA1 // vendor: mask of the targets to program
+#define PARM_GANG_FAIL 0xA2 // vendor: mask of the targets that failed
+#define PARM_DIFF 0xA3 // vendor: compare flash pages before writing them
+#define PARM_DIFF_ERASE 0xA4 // vendor: pages refused for want of an erase
+
+// Serial rates the host can switch to with '@' PARM_BAUD. All of them are
+// exact with U2X on a 16MHz Arduino. Index 0 is the rate the sketch starts
+// with and returns to on 'Q' or when the host goes quiet for BAUD_TIMEOUT.
+// A const table is copied to SRAM, the lean build keeps only the first rate.
+#if LEAN
+#define BAUDS 1
+#define BAUD_RATE(index) 115200UL
+#else
+static const uint32_t _bauds[] =
+{ 115200, 250000, 500000, 1000000 };
+#define BAUDS (sizeof(_bauds) / sizeof(_bauds[0]))
+#define BAUD_RATE(index) _bauds[index]
+#endif
+#define BAUD_TIMEOUT 1000 // ms
+static uint8_t _baud = 0;
+static uint32_t _last_rx;
+
+// Serial line driven by the sketch instead of the core: the receive ring is
+// filled by the USART interrupt and holds a page with its header, so SPI work
+// and target waits may run while a page comes in. With UART_RTS_PIN the line
+// is also paced, the pin (to the host's CTS) goes high when the ring is
+// nearly full and low again when it has drained. XON/XOFF can't be used, the
+// protocol is binary and 0x11 is STK_FAILED. Only where the host is on
+// USART0, the 32U4 boards (Leonardo, Micro) talk over USB and keep Serial.
+#if defined(UCSR0A)
+#define UART_RING 1
+#else
+#define UART_RING 0
+#endif
+#define UART_RX_LENGTH 320 // 'd' len(2) memtype, BUFF_LENGTH data, CRC_EOP
+#define UART_TX_LENGTH 64
+#define UART_RTS_PIN 0 // 0 for none
+#define UART_RTS_SLACK 32 // bytes the host may still send once RTS is high
+#define FRAME_TIMEOUT 500 // ms, a command cut short is dropped after this
+
+
+// Target geometry. PROFILE_GENERIC takes it from the host ('B', 'E' and the
+// v2 messages). The others fix it at build time for fixtures that only ever
+// program the one part, the page masks and limits then fold into constants
+// and the extended address is left out where the flash has no use for it.
+#define PROFILE_GENERIC	0
+#define PROFILE_M328P	1
+#define PROFILE_M2560	2
+#define PROFILE_T85		3
+#define TARGET_PROFILE	PROFILE_GENERIC
+
+#if TARGET_PROFILE == PROFILE_M328P
+#define TARGET_FLASH_PAGESIZE	128
+#define TARGET_EEPROM_SIZE		1024
+#define TARGET_EEPROM_PAGESIZE	4
+#define TARGET_EXTENDED			0
+#elif TARGET_PROFILE == PROFILE_M2560
+#define TARGET_FLASH_PAGESIZE	256
+#define TARGET_EEPROM_SIZE		4096
+#define TARGET_EEPROM_PAGESIZE	8
+#define TARGET_EXTENDED			1
+#elif TARGET_PROFILE == PROFILE_T85
+#define TARGET_FLASH_PAGESIZE	64
+#define TARGET_EEPROM_SIZE		512
+#define TARGET_EEPROM_PAGESIZE	4
+#define TARGET_EXTENDED			0
+#endif
+
+#if TARGET_PROFILE == PROFILE_GENERIC
+#define FLASH_PAGESIZE	_param.flash_pagesize
+#define EEPROM_SIZE		_param.eeprom_size
+#define EEPROM_PAGESIZE	_param.eeprom_pagesize
+#define TARGET_EXTENDED	1
+#else
+#define FLASH_PAGESIZE	TARGET_FLASH_PAGESIZE
+#define EEPROM_SIZE		TARGET_EEPROM_SIZE
+#define EEPROM_PAGESIZE	TARGET_EEPROM_PAGESIZE
+#endif
+
+#if LEAN
+#if TARGET_PROFILE == PROFILE_GENERIC || STANDALONE || GANG_TARGETS > 1
+#error the lean build needs a TARGET_PROFILE, without STANDALONE or gang
+#endif
+// Next to the page buffer: the sketch's other statics, about 80 bytes, the
+// core's serial rings, Serial and millis(), about 50, and the stack down
+// the page write path with an interrupt on top, about 50. An estimate,
+// avr-size and a look at the stack have the last word.
+#define LEAN_RAM_OTHER 180
+#if defined(RAMEND) && defined(RAMSTART) \
+		&& TARGET_FLASH_PAGESIZE + LEAN_RAM_OTHER > RAMEND - RAMSTART + 1
+#error the page buffer of this TARGET_PROFILE leaves no room on this host
+#endif
+#define BUFF_LENGTH TARGET_FLASH_PAGESIZE
+#define PAGE_BUFFERS 1
+#undef UART_RING
+#define UART_RING 0
+#else
 #define BUFF_LENGTH 256
+#define PAGE_BUFFERS 2
+#endif
+
+// longest wait for a self-timed flash or EEPROM write (ms)
+#define POLL_TIMEOUT 20
+// wait used when neither RDY/BSY nor value polling is possible (ms)
+#define WRITE_DELAY 10
+// chip erase: longest RDY/BSY wait and the fixed wait without it (ms)
+#define ERASE_TIMEOUT 100
+#define ERASE_DELAY 20
 
 static bool _error = false;
+static uint8_t _fault = 0; // FAULT_*, what LED_ERROR blinks
+
+// error classes, LED_ERROR blinks as many times in a row, 0 keeps it lit
+#define FAULT_OTHER		0
+#define FAULT_SYNC		1 // STK_NOSYNC, bad v2 checksum
+#define FAULT_DEVICE	2 // the target does not answer
+#define FAULT_WRITE		3 // a write or erase timed out
+
+void fault(uint8_t kind)
+{
+	_error = true;
+	_fault = kind;
+}
+
+void clearError()
+{
+	_error = false;
+	_fault = FAULT_OTHER;
+}
 static bool _programming = false;
-uint8_t _buff[BUFF_LENGTH]; // global block storage
+static bool _erased = false; // chip erase seen since entering programming mode
+
+// Flash pages known to be written since programming mode was entered or
+// the chip erased, for VND_RESUME. A host which lost sync asks for it
+// rather than starting over from a chip erase.
+static struct
+{
+	uint16_t pages;
+	uint32_t address; // word address of the last one
+} _resume;
+
+bool setErased(bool erased)
+{
+	_erased = erased;
+	_resume.pages = 0;
+	return erased;
+}
+static uint8_t _ext_addr = 0; // extended address byte (0x4D) the target holds
+static uint8_t _gang_select = 1; // targets to program
+static uint8_t _gang_active = 1; // targets in programming mode
+static uint8_t _gang_fail = 0; // targets that dropped out or read back wrong
+static bool _diff = false; // PARM_DIFF
+static uint8_t _diff_erase = 0; // PARM_DIFF_ERASE
+
+// Session counters for VND_STATS. The times are in us and overlap: a poll
+// wait includes the SPI instructions it sends, a serial wait the page task
+// steps run meanwhile. With PHASE_PINS each phase also drives a pin of its
+// own high for a logic analyzer, it costs a digitalWrite() per phase.
+#define STATS			(!LEAN)
+#define PHASE_PINS		0
+#define PHASE_SERIAL	3
+#define PHASE_SPI		5
+#define PHASE_POLL		6
+#if STATS && PHASE_PINS && GANG_TARGETS > 1
+#error the phase pins are in use by the gang
+#endif
+
+#if STATS
+static struct
+{
+	uint32_t serial; // waiting for the host in getch() and fill()
+	uint32_t spi; // in spiTransfer()
+	uint32_t poll; // waiting for commits and writes
+	uint16_t pages; // flash pages written
+	uint16_t skipped; // blank pages left out after a chip erase
+	uint16_t nosync; // STK_NOSYNC answers and bad v2 checksums
+	uint16_t retries; // slower clocks tried to get in sync
+} _stats;
+
+uint32_t phaseBegin(uint8_t pin)
+{
+#if PHASE_PINS
+	digitalWrite(pin, HIGH);
+#else
+	(void) pin;
+#endif
+	return micros();
+}
+
+void phaseEnd(uint8_t pin, uint32_t &counter, uint32_t start)
+{
+	counter += micros() - start;
+#if PHASE_PINS
+	digitalWrite(pin, LOW);
+#else
+	(void) pin;
+#endif
+}
 
+#define STAT_COUNT(c)		(_stats.c++)
+#define PHASE_BEGIN(pin)	uint32_t _phase_start = phaseBegin(pin)
+#define PHASE_END(pin, c)	phaseEnd(pin, _stats.c, _phase_start)
+#else
+#define STAT_COUNT(c)		((void) 0)
+#define PHASE_BEGIN(pin)
+#define PHASE_END(pin, c)
+#endif
+
+// Page storage is double buffered: _buff is the half being filled from the
+// serial line, the other half may still be loading into the target. The
+// lean build has the one buffer, a page is loaded in one go before the
+// answer lets the host send the next.
+uint8_t _pages[PAGE_BUFFERS][BUFF_LENGTH];
+uint8_t *_buff = _pages[0]; // global block storage
+
+// the parts of the 'B' device parameters the sketch has a use for
 typedef struct param
 {
-	uint8_t signature;
-	uint8_t revision;
-	uint8_t progtype;
-	uint8_t parmode;
 	uint8_t polling;
-	uint8_t selftimed;
-	uint8_t lock_bytes;
-	uint8_t fuse_bytes;
 	uint8_t flash_poll;
 	uint16_t eeprom_poll;
 	uint16_t flash_pagesize; // in bytes
 	uint16_t eeprom_size;
-	uint32_t flash_size;
+	uint8_t eeprom_pagesize; // from the v2 page mode bit, 0 for byte writes
 } parameter;
 
 parameter _param;
 
-void reply(bool has_byte = false, byte val = 0x00, bool send_ok = true);
+// SPI clock dividers, fastest first. beginProgramming() walks down the table
+// until the target answers, _sck_index is the divider in use (2 << index).
+// Past the hardware dividers the clock is bit-banged and goes on halving,
+// down to 3.9kHz for targets running from 128kHz with CKDIV8 set. The host
+// may make the walk start at a slower step with the SCK duration. Unless the
+// host asked for the step the target answered at, the one after it is used.
+#if LEAN
+#define SCK_DIVIDERS 7 // bit-banged as fast as they go
+#else
+static const uint8_t _sck_dividers[] =
+{ SPI_CLOCK_DIV2, SPI_CLOCK_DIV4, SPI_CLOCK_DIV8, SPI_CLOCK_DIV16,
+		SPI_CLOCK_DIV32, SPI_CLOCK_DIV64, SPI_CLOCK_DIV128 };
+#define SCK_DIVIDERS sizeof(_sck_dividers)
+#endif
+#define SCK_STEPS (SCK_DIVIDERS + 5)
+static uint8_t _sck_index = SCK_DIVIDERS - 1;
+static uint8_t _sck_first = 0; // fastest step beginProgramming() tries
+
+void reply(bool has_byte = false, byte val = 0x00, bool send_ok = true,
+		bool ok = true);
 void pulse(uint8_t pin, uint8_t times);
+#if LED_TIMER
+void ledBegin();
+#endif
 void avrisp();
+void pageTask();
+bool flushPage();
+void serialNumberLoad();
+uint8_t ispByte(uint8_t b);
+bool waitReady(uint8_t read_cmd, uint16_t addr, uint8_t value, uint8_t poll1,
+		uint8_t poll2);
+#if STANDALONE
+void storeBegin();
+void button();
+#endif
+
+#if UART_RING
+#if defined(USART_RX_vect)
+#define UART_RX_VECT USART_RX_vect
+#define UART_UDRE_VECT USART_UDRE_vect
+#else
+#define UART_RX_VECT USART0_RX_vect
+#define UART_UDRE_VECT USART0_UDRE_vect
+#endif
+
+// Drop-in for the little of HardwareSerial the sketch uses. The core's
+// Serial must not be linked in, it brings its own USART interrupts.
+struct Uart
+{
+	uint8_t rx[UART_RX_LENGTH];
+	volatile uint16_t rx_head; // moved by the interrupt
+	volatile uint16_t rx_tail;
+	uint8_t tx[UART_TX_LENGTH];
+	volatile uint8_t tx_head;
+	volatile uint8_t tx_tail; // moved by the interrupt
+	bool written; // TXC0 is only meaningful after a write
+	volatile uint8_t *rts_port;
+	uint8_t rts_bit;
+
+	void begin(uint32_t baud)
+	{
+		UCSR0B = 0;
+		UCSR0A = _BV(U2X0);
+		UBRR0 = (F_CPU / 4 / baud - 1) / 2;
+		UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+		rx_head = rx_tail = 0;
+		tx_head = tx_tail = 0;
+		written = false;
+#if UART_RTS_PIN
+		pinMode(UART_RTS_PIN, OUTPUT);
+		rts_port = portOutputRegister(digitalPinToPort(UART_RTS_PIN));
+		rts_bit = digitalPinToBitMask(UART_RTS_PIN);
+		*rts_port &= ~rts_bit;
+#endif
+		UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+	}
+
+	// bytes in the ring, called with the interrupt masked or from it
+	uint16_t used()
+	{
+		return rx_head >= rx_tail ? rx_head - rx_tail
+				: UART_RX_LENGTH + rx_head - rx_tail;
+	}
+
+	int available()
+	{
+		uint8_t sreg = SREG;
+		cli();
+		uint16_t n = used();
+		SREG = sreg;
+		return n;
+	}
+
+	void take(uint16_t n)
+	{
+		uint16_t tail = rx_tail + n;
+		if (tail >= UART_RX_LENGTH)
+			tail -= UART_RX_LENGTH;
+
+		uint8_t sreg = SREG;
+		cli();
+		rx_tail = tail;
+#if UART_RTS_PIN
+		if (used() < UART_RX_LENGTH - 2 * UART_RTS_SLACK)
+			*rts_port &= ~rts_bit;
+#endif
+		SREG = sreg;
+	}
+
+	// byte i of those in the ring
+	uint8_t peek(uint16_t i)
+	{
+		i += rx_tail;
+		return rx[i < UART_RX_LENGTH ? i : i - UART_RX_LENGTH];
+	}
+
+	int read()
+	{
+		if (!available())
+			return -1;
+		uint8_t b = rx[rx_tail];
+		take(1);
+		return b;
+	}
+
+	// copy the bytes that are in, up to n and to the end of the ring
+	uint16_t read(uint8_t *p, uint16_t n)
+	{
+		uint16_t run = available();
+		if (run > n)
+			run = n;
+		if (run > UART_RX_LENGTH - rx_tail)
+			run = UART_RX_LENGTH - rx_tail;
+		memcpy(p, rx + rx_tail, run);
+		take(run);
+		return run;
+	}
+
+	size_t write(uint8_t b)
+	{
+		uint8_t head = (tx_head + 1) % UART_TX_LENGTH;
+		while (head == tx_tail)
+			;
+		tx[tx_head] = b;
+
+		uint8_t sreg = SREG;
+		cli();
+		tx_head = head;
+		written = true;
+		UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0);
+		UCSR0B |= _BV(UDRIE0);
+		SREG = sreg;
+		return 1;
+	}
+
+	size_t print(const char *s)
+	{
+		size_t n = 0;
+		while (*s)
+			n += write(*s++);
+		return n;
+	}
+
+	void flush()
+	{
+		if (!written)
+			return;
+		while (UCSR0B & _BV(UDRIE0))
+			;
+		while (!(UCSR0A & _BV(TXC0)))
+			;
+	}
+};
+
+static Uart _uart;
+#define Serial _uart
+
+ISR(UART_RX_VECT)
+{
+	uint8_t b = UDR0;
+	uint16_t head = _uart.rx_head + 1;
+	if (head == UART_RX_LENGTH)
+		head = 0;
+
+	// a full ring drops the byte, the protocol notices the loss
+	if (head != _uart.rx_tail)
+	{
+		_uart.rx[_uart.rx_head] = b;
+		_uart.rx_head = head;
+	}
+
+#if UART_RTS_PIN
+	if (_uart.used() >= UART_RX_LENGTH - UART_RTS_SLACK)
+		*_uart.rts_port |= _uart.rts_bit;
+#endif
+}
+
+ISR(UART_UDRE_VECT)
+{
+	uint8_t tail = _uart.tx_tail;
+	if (tail == _uart.tx_head)
+	{
+		UCSR0B &= ~_BV(UDRIE0);
+		return;
+	}
+
+	UDR0 = _uart.tx[tail];
+	_uart.tx_tail = (tail + 1) % UART_TX_LENGTH;
+}
+#endif
+
+static bool _rx_lost = false; // the host went quiet in the middle of a command
 
+#if !LED_TIMER
 void heartbeat()
 {
 	static bool state;
@@ -108,17 +620,19 @@ void heartbeat()
 	digitalWrite(LED_PROGRAMMING, _programming);
 	digitalWrite(LED_ERROR, _error);
 }
+#endif
 
 void setup()
 {
-	Serial.begin(115200);
+	Serial.begin(BAUD_RATE(0));
 
+#if !LEAN
 	SPI.setDataMode(0);
 	SPI.setBitOrder(MSBFIRST);
 
-	// Clock Div can be 2,4,8,16,32,64, or 128
-	// if the target is m8 runs at 16MHz, the spi could run at SPI_CLOCK_DIV4
-	SPI.setClockDivider(SPI_CLOCK_DIV8);
+	// the clock divider is negotiated with the target in beginProgramming()
+	SPI.setClockDivider(_sck_dividers[_sck_index]);
+#endif
 
 	pinMode(LED_PROGRAMMING, OUTPUT);
 	pulse(LED_PROGRAMMING, 2);
@@ -129,29 +643,206 @@ void setup()
 	pinMode(LED_HEARTBEAT, OUTPUT);
 	pulse(LED_HEARTBEAT, 2);
 
+#if LED_TIMER
+	ledBegin();
+#endif
+
+#if STATS && PHASE_PINS
+	pinMode(PHASE_SERIAL, OUTPUT);
+	pinMode(PHASE_SPI, OUTPUT);
+	pinMode(PHASE_POLL, OUTPUT);
+#endif
+
+#if STANDALONE
+	storeBegin();
+#endif
+
+#if !LEAN
+	serialNumberLoad();
+#endif
+}
+
+void setBaud(uint8_t index)
+{
+	// the reply to the request still goes out at the old rate
+	Serial.flush();
+	Serial.begin(BAUD_RATE(index));
+	_baud = index;
+	_last_rx = millis();
+}
+
+#if UART_RING
+// Bytes the command at the head of the ring takes up to its CRC_EOP, as far
+// as the n bytes in so far tell.
+uint16_t frameLength(uint16_t n)
+{
+	switch (Serial.peek(0))
+	{
+	case CRC_EOP:
+		return 1;
+	case 'A':
+	case 0x61:
+	case VND_STATS:
+		return 3;
+	case '@':
+	case 'U':
+	case 0x60:
+		return 4;
+	case 0x74:
+		return 5;
+	case 'V':
+		return 6;
+	case 'E':
+	case VND_CHECKSUM:
+	case VND_STREAM_WRITE: // the pages are taken in by the command
+	case VND_DUMP:
+		return 7;
+	case 'B':
+		return 22;
+	case VND_BATCH: // count flags instructions CRC_EOP
+		return n < 2 ? 2 : 4 + 4 * Serial.peek(1);
+	case VND_PACKED_WRITE: // memtype len(2) plen(2) data CRC_EOP
+		return n < 6 ? 6 : 7 + makeWord(Serial.peek(4), Serial.peek(5));
+	case VND_JOB: // len(2) records CRC_EOP
+		return n < 3 ? 3 : 4 + makeWord(Serial.peek(1), Serial.peek(2));
+	case VND_SERIAL_NUMBER:
+		return 12;
+	case VND_INJECT: // len data CRC_EOP
+		return n < 2 ? 2 : 3 + Serial.peek(1);
+	case 0x64: // 'd' len(2) memtype data CRC_EOP
+		return n < 3 ? 3 : 5 + makeWord(Serial.peek(1), Serial.peek(2));
+#if STANDALONE
+	case VND_STORE_READ:
+		return 8;
+	case VND_STORE_WRITE:
+		return n < 7 ? 7 : 8 + makeWord(Serial.peek(5), Serial.peek(6));
+#endif
+#if STK500V2
+	case MESSAGE_START: // seq size(2) TOKEN body checksum
+		return n < 4 ? 4 : 6 + makeWord(Serial.peek(2), Serial.peek(3));
+#endif
+	default: // the command and CRC_EOP
+		return 2;
+	}
+}
+
+// Commands are only started once they are in the ring as a whole, so the
+// handlers never wait for the host and loop() keeps running in between.
+// One that can't fit starts when the ring is full.
+bool frameReady()
+{
+	static uint16_t seen;
+	uint16_t n = Serial.available();
+
+	if (n != seen)
+	{
+		seen = n;
+		_last_rx = millis();
+	}
+	if (!n)
+		return false;
+
+	uint16_t length = frameLength(n);
+	if (n >= length || n >= UART_RX_LENGTH - 1)
+	{
+		seen = 0;
+		_rx_lost = false;
+		return true;
+	}
+
+	// the host gave up half way through, don't let the rest of it stick
+	if (millis() - _last_rx > FRAME_TIMEOUT)
+	{
+		fault(FAULT_SYNC);
+		Serial.take(n);
+		seen = 0;
+	}
+	return false;
+}
+#else
+bool frameReady()
+{
+	return Serial.available();
 }
+#endif
 
 void loop(void)
 {
+#if !LED_TIMER
 	heartbeat();
+#endif
+	pageTask();
+
+#if STANDALONE
+	button();
+#endif
 
-	if (Serial.available())
+	// lost the host at the fast rate, wait for it at the default one
+	if (_baud && millis() - _last_rx > BAUD_TIMEOUT)
+		setBaud(0);
+
+	if (frameReady())
+	{
 		avrisp();
+		// the quiet time starts with the answer, a dump or a burn may take
+		// longer than BAUD_TIMEOUT
+		_last_rx = millis();
+	}
 }
 
 uint8_t getch()
 {
-	while (!Serial.available())
-		;
+	// a step of the pending page load per byte keeps SPI busy while the
+	// next page comes in
+	pageTask();
+	if (!Serial.available())
+	{
+		PHASE_BEGIN(PHASE_SERIAL);
+		do
+		{
+			pageTask();
+#if UART_RING
+			// only the pages of VND_STREAM_WRITE get here
+			if (millis() - _last_rx > FRAME_TIMEOUT)
+				_rx_lost = true;
+			if (_rx_lost)
+			{
+				PHASE_END(PHASE_SERIAL, serial);
+				return 0x00;
+			}
+#endif
+		} while (!Serial.available());
+		PHASE_END(PHASE_SERIAL, serial);
+	}
+	_last_rx = millis();
 	return Serial.read();
 }
 
-void fill(uint8_t n)
+void fill(uint16_t n)
 {
-	for (uint8_t i = 0; i < n; i++)
+#if UART_RING
+	// whole runs out of the ring, the page task still gets a step per run
+	PHASE_BEGIN(PHASE_SERIAL);
+	uint16_t i = 0;
+	while (i < n && !_rx_lost)
+	{
+		pageTask();
+		uint16_t run = Serial.read(_buff + i, n - i);
+		if (run)
+		{
+			i += run;
+			_last_rx = millis();
+		}
+		else if (millis() - _last_rx > FRAME_TIMEOUT)
+			_rx_lost = true;
+	}
+	PHASE_END(PHASE_SERIAL, serial);
+#else
+	for (uint16_t i = 0; i < n; i++)
 	{
 		_buff[i] = getch();
 	}
+#endif
 }
 
 void pulse(uint8_t pin, uint8_t times)
@@ -165,262 +856,2782 @@ void pulse(uint8_t pin, uint8_t times)
 	}
 }
 
-uint8_t spiTransfer(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+struct pin
 {
-	SPI.transfer(a);
-	SPI.transfer(b);
-	SPI.transfer(c);
-	return SPI.transfer(d);
-}
+	volatile uint8_t *reg; // PORTx of an output, PINx of an input
+	uint8_t mask;
+};
 
-uint8_t spiTransfer(uint8_t a, uint16_t b, uint8_t c)
+pin pinOut(uint8_t p)
 {
-	return spiTransfer(a, highByte(b), lowByte(b), c);
+	pinMode(p, OUTPUT);
+	pin x =
+	{ portOutputRegister(digitalPinToPort(p)), digitalPinToBitMask(p) };
+	return x;
 }
 
-bool receiveEop()
+pin pinIn(uint8_t p)
 {
-	bool eop = getch() == CRC_EOP;
-
-	if (eop)
-		Serial.write(STK_INSYNC);
-	else
-	{
-		_error = true;
-		Serial.write(STK_NOSYNC);
-	}
-
-	return eop;
+	pinMode(p, INPUT);
+	pin x =
+	{ portInputRegister(digitalPinToPort(p)), digitalPinToBitMask(p) };
+	return x;
 }
 
-void reply(bool has_byte, byte val, bool send_ok)
+inline void pinSet(const pin &p, bool level)
 {
-	if (!receiveEop())
-		return;
-
-	if (has_byte)
-		Serial.write(val);
-
-	if (send_ok)
-		Serial.write(STK_OK);
+	if (level)
+		*p.reg |= p.mask;
+	else
+		*p.reg &= ~p.mask;
 }
 
-void replyVersion(uint8_t c)
+#if LED_TIMER
+// The LEDs are driven from the timer 0 compare interrupt, about 1kHz next
+// to the core's overflow for millis(), so the command path never spends a
+// cycle on them. LED_HEARTBEAT blinks at 1Hz, LED_PROGRAMMING is lit in
+// programming mode and blinks with the pages written, LED_ERROR blinks the
+// class of the error in a 1.5s frame.
+static pin _led_heartbeat, _led_error, _led_programming;
+static volatile uint8_t _led_pages; // pages written
+static volatile uint8_t _led_flash; // half periods of ledFlash() left
+static const pin *_led_flashing;
+
+void ledBegin()
 {
-	switch (c)
-	{
-	case 0x80:
-		reply(true, HARDWARE_VERSION);
-		break;
-	case 0x81:
-		reply(true, FIRMWARE_MAJOR_VERSION);
-		break;
-	case 0x82:
-		reply(true, FIRMWARE_MINOR_VERSION);
-		break;
-	case 0x93:
-		reply(true, 'S'); // serial programmer
-		break;
-	default:
-		reply(true);
-		break;
-	}
+	_led_heartbeat = pinOut(LED_HEARTBEAT);
+	_led_error = pinOut(LED_ERROR);
+	_led_programming = pinOut(LED_PROGRAMMING);
+	OCR0A = 0x80;
+	TIMSK0 |= _BV(OCIE0A);
 }
 
-void setParameters()
+// a few quick flashes of a LED over the state it shows
+void ledFlash(const pin &led, uint8_t times)
 {
-	// call this after reading paramter packet into buff[]
-	_param.signature = _buff[0];
-	_param.revision = _buff[1];
-	_param.progtype = _buff[2];
-	_param.parmode = _buff[3];
-	_param.polling = _buff[4];
-	_param.selftimed = _buff[5];
-	_param.lock_bytes = _buff[6];
-	_param.fuse_bytes = _buff[7];
-	_param.flash_poll = _buff[8];
-
-	_param.eeprom_poll = makeWord(_buff[10], _buff[11]);
-	_param.flash_pagesize = makeWord(_buff[12], _buff[13]);
-	_param.eeprom_size = makeWord(_buff[14], _buff[15]);
-
-	// 32 bits flashsize (big endian)
-	_param.flash_size = _buff[16] * 0x01000000 + _buff[17] * 0x00010000
-			+ _buff[18] * 0x00000100 + _buff[19];
+	uint8_t sreg = SREG;
+	cli();
+	_led_flashing = &led;
+	_led_flash = times * 2;
+	SREG = sreg;
 }
 
-void beginProgramming()
+// Countdowns only, a divide or modulo here is a library call with every
+// call-clobbered register saved, long enough for USART0 to overrun at
+// 1Mbaud. The pins follow in steps of 10 ticks.
+ISR(TIMER0_COMPA_vect)
 {
-	SPI.begin();
+	static uint8_t step = 1; // ticks to the next step
+	static uint8_t beat = 1; // steps to the next heartbeat toggle
+	static uint8_t frame = 1; // steps left of the error frame
+	static uint8_t blink = 1; // steps left of the blink half
+	static uint8_t halves; // blink halves left in the frame
+	static uint8_t flash = 1; // steps left of the flash half
+	static bool heartbeat;
+
+	if (--step)
+		return;
+	step = 10;
 
-	digitalWrite(RESET, HIGH);
-	pinMode(RESET, OUTPUT);
+	if (!--beat)
+	{
+		beat = 50;
+		heartbeat = !heartbeat;
+		pinSet(_led_heartbeat, heartbeat);
+	}
 
-	digitalWrite(SCK, LOW);
-	digitalWrite(RESET, LOW);
-	digitalWrite(RESET, HIGH);
-	digitalWrite(RESET, LOW);
+	// _fault blinks of 150ms on and 150ms off, in a frame of 1.5s
+	if (!--frame)
+	{
+		frame = 150;
+		halves = _fault * 2;
+		blink = 1;
+	}
+	if (!--blink)
+	{
+		blink = 15;
+		if (halves)
+			halves--;
+	}
 
-	delay(20);
+	pinSet(_led_error, _error && (!_fault || (halves & 1)));
+	pinSet(_led_programming,
+			_programming && !((_led_pages / LED_PAGES) & 1));
 
-	spiTransfer(0xAC, 0x53, 0x00, 0x00);
-	_programming = true;
+	if (_led_flash)
+	{
+		if (!--flash)
+		{
+			flash = 3;
+			_led_flash--;
+		}
+		pinSet(*_led_flashing, _led_flash & 1);
+	}
 }
+#endif
 
-void endProgramming()
+// half an SCK period of the clock step in use, in us, 256 for the slowest
+// step on an 8MHz host
+uint16_t sckHalf()
 {
-	SPI.end();
-	digitalWrite(RESET, HIGH);
-	pinMode(RESET, INPUT);
-	_programming = false;
+	return (1 << _sck_index) / (F_CPU / 1000000);
 }
 
-void universal()
+bool softClock()
 {
-	uint8_t ch;
-
-	fill(4);
-	ch = spiTransfer(_buff[0], _buff[1], _buff[2], _buff[3]);
-	reply(true, ch);
+	return LEAN || _sck_index >= SCK_DIVIDERS;
 }
 
-uint16_t getPage(uint16_t addr)
+static pin _soft_mosi, _soft_sck, _soft_miso;
+
+void softBegin()
 {
-	return addr & ~((_param.flash_pagesize >> 1) - 1);
+	_soft_mosi = pinOut(ISP_MOSI);
+	_soft_sck = pinOut(ISP_SCK);
+	_soft_miso = pinIn(ISP_MISO);
 }
 
-void writeFlash(uint16_t address, uint16_t length)
+// Bit-banged exchange for the clock steps below SPI_CLOCK_DIV128
+uint8_t softByte(uint8_t b)
 {
-	if (length > _param.flash_pagesize || length > BUFF_LENGTH)
+	uint16_t half = sckHalf();
+#if !LEAN
+	uint8_t spcr = SPCR;
+	SPCR &= ~_BV(SPE);
+#endif
+
+	for (uint8_t i = 8; i--;)
 	{
-		_error = true;
-		Serial.write(STK_FAILED);
-		return;
+		pinSet(_soft_mosi, b & 0x80);
+		b <<= 1;
+		delayMicroseconds(half);
+		pinSet(_soft_sck, HIGH);
+		if (*_soft_miso.reg & _soft_miso.mask)
+			b |= 1;
+		delayMicroseconds(half);
+		pinSet(_soft_sck, LOW);
 	}
 
-	fill(length);
+#if !LEAN
+	SPCR = spcr;
+#endif
+	return b;
+}
 
-	if (!receiveEop())
-		return;
+#if GANG_TARGETS > 1
+static pin _gang_mosi, _gang_sck, _gang_miso[GANG_TARGETS];
+static uint8_t _gang_in[GANG_TARGETS]; // last byte from each target
 
-	for (uint8_t *p = _buff, word_length = length >> 1, i = 0; i < word_length;
-			i++)
-	{
-		spiTransfer(0x40, i, *p++);
-		spiTransfer(0x48, i, *p++);
-	}
-	spiTransfer(0x4C, getPage(address), 0);
+void gangBegin()
+{
+	_gang_mosi = pinOut(ISP_MOSI);
+	_gang_sck = pinOut(ISP_SCK);
+	for (uint8_t t = 0; t < GANG_TARGETS; t++)
+		_gang_miso[t] = pinIn(_gang_miso_pins[t]);
+}
 
-	Serial.write(STK_OK);
+bool gang()
+{
+	return _gang_active & (_gang_active - 1);
 }
 
-void writeEeprom(uint16_t address, uint16_t length)
+// Bit-banged exchange while several targets are in programming mode, the
+// hardware SPI can only listen to one MISO. Returns the byte of the first
+// target in programming mode.
+uint8_t gangByte(uint8_t b)
 {
-	if (length > _param.eeprom_size || length > BUFF_LENGTH)
+	uint16_t half = sckHalf();
+	uint8_t spcr = SPCR;
+	SPCR &= ~_BV(SPE);
+
+	for (uint8_t i = 8; i--;)
 	{
-		_error = true;
-		Serial.write(STK_FAILED);
-		return;
+		pinSet(_gang_mosi, b & 0x80);
+		b <<= 1;
+		delayMicroseconds(half);
+		pinSet(_gang_sck, HIGH);
+		for (uint8_t t = 0; t < GANG_TARGETS; t++)
+			_gang_in[t] = _gang_in[t] << 1
+					| (*_gang_miso[t].reg & _gang_miso[t].mask ? 1 : 0);
+		delayMicroseconds(half);
+		pinSet(_gang_sck, LOW);
 	}
 
-	fill(length);
+	SPCR = spcr;
 
-	if (!receiveEop())
-		return;
+	uint8_t t = 0;
+	while (!(_gang_active & _BV(t)))
+		t++;
+	return _gang_in[t];
+}
+#endif
 
-	uint8_t * p = _buff;
-	for (uint16_t i = length, addr = address << 1; i--;)
+// targets in programming mode whose last byte read equals value in the bits
+// of mask
+uint8_t targetsMatching(uint8_t last, uint8_t value, uint8_t mask = 0xFF)
+{
+#if GANG_TARGETS > 1
+	if (gang())
 	{
-		spiTransfer(0xC0, addr++, *p++);
-		delay(4);
+		uint8_t targets = 0;
+		for (uint8_t t = 0; t < GANG_TARGETS; t++)
+			if (_gang_active & _BV(t) && (_gang_in[t] & mask) == value)
+				targets |= _BV(t);
+		return targets;
 	}
-	Serial.write(STK_OK);
+#endif
+	return (last & mask) == value ? _gang_active : 0;
 }
 
-void programPage(uint16_t address)
+// Check a byte every target should have answered alike, the ones which did
+// not are marked failed.
+uint8_t gangCheck(uint8_t value)
 {
-	uint16_t length = (getch() << 8) | getch(); // It is weird that makeWord does not work here
-	uint8_t memtype = getch();
+	uint8_t failed = _gang_active & ~targetsMatching(value, value);
 
-	switch (memtype)
+	if (failed)
 	{
-	case 'F':
-		writeFlash(address, length);
-		break;
-	case 'E':
-		writeEeprom(address, length);
-		break;
-	default:
-		Serial.write(STK_FAILED);
-		break;
+		_gang_fail |= failed;
+		fault(FAULT_WRITE);
 	}
+	return value;
 }
 
-void readFlashPage(uint16_t address, uint16_t length)
+void resetTargets(uint8_t level)
 {
-	for (uint16_t i = 0; i < length; i += 2)
-	{
-		Serial.write(spiTransfer(0x20, address, 0));
-		Serial.write(spiTransfer(0x28, address, 0));
-		address++;
-	}
-	Serial.write(STK_OK);
+#if GANG_TARGETS > 1
+	for (uint8_t t = 0; t < GANG_TARGETS; t++)
+		if (_gang_active & _BV(t))
+			digitalWrite(_gang_reset_pins[t], level);
+#else
+	digitalWrite(RESET, level);
+#endif
 }
 
-void readEepromPage(uint16_t address, uint16_t length)
+// SPI instruction engine: streams the 4-byte ISP instructions for a block of
+// memory, one data byte per instruction. The data byte goes out from buff
+// (load) or the answer is stored there (read). At slow clock rates it runs
+// from the SPI interrupt so the CPU is free for the serial line, at fast
+// ones a byte takes less than the interrupt overhead and it runs in a
+// tight loop instead.
+#define SPI_IRQ_INDEX 3 // SPI_CLOCK_DIV16 and slower
+
+static struct
 {
-	// here again we have a word address
-	for (uint16_t addr = address * 2, i = 0; i < length; i++)
+	volatile bool busy;
+	volatile uint16_t count; // data bytes done
+	bool load;
+	uint8_t cmd;
+	uint8_t toggle; // or-ed into cmd for odd bytes (high byte of a word)
+	uint8_t shift; // data bytes per address step, 1 for words
+	uint8_t phase;
+	uint16_t address;
+	uint16_t length;
+	uint8_t *buff;
+} _spi;
+
+uint8_t spiNext()
+{
+	uint16_t address = _spi.address + (_spi.count >> _spi.shift);
+
+	switch (_spi.phase)
 	{
-		uint8_t ee = spiTransfer(0xA0, addr++, 0xFF);
-		Serial.write(ee);
+	case 0:
+		return _spi.count & 1 ? _spi.cmd | _spi.toggle : _spi.cmd;
+	case 1:
+		return highByte(address);
+	case 2:
+		return lowByte(address);
+	default:
+		return _spi.load ? _spi.buff[_spi.count] : 0x00;
 	}
-	Serial.write(STK_OK);
 }
 
-void readPage(uint16_t address)
+// the byte sent by spiNext() is done, returns false at the end of the block
+bool spiStep(uint8_t in)
 {
-	uint16_t length = (getch() << 8) | getch();
+	if (++_spi.phase < 4)
+		return true;
 
-	uint8_t memtype = getch();
+	if (!_spi.load)
+		_spi.buff[_spi.count] = in;
 
-	if (!receiveEop())
-		return;
+	_spi.phase = 0;
+	if (++_spi.count < _spi.length)
+		return true;
 
-	switch (memtype)
-	{
-	case 'F':
-		readFlashPage(address, length);
-		break;
-	case 'E':
-		readEepromPage(address, length);
-		break;
-	default:
-		Serial.write(STK_FAILED);
-		break;
-	}
+	_spi.busy = false;
+	return false;
 }
 
-void readSignature()
+#if !LEAN
+ISR(SPI_STC_vect)
 {
-	if (!receiveEop())
-		return;
-
-	Serial.write(spiTransfer(0x30, 0x00, 0x00, 0x00));
-	Serial.write(spiTransfer(0x30, 0x00, 0x01, 0x00));
-	Serial.write(spiTransfer(0x30, 0x00, 0x02, 0x00));
-
-	Serial.write(STK_OK);
+	if (spiStep(SPDR))
+		SPDR = spiNext();
+	else
+		SPCR &= ~_BV(SPIE);
 }
+#endif
 
-void avrisp()
+void spiStart(uint8_t cmd, uint8_t toggle, bool load, uint16_t address,
+		uint8_t *buff, uint16_t length)
 {
-	static uint16_t address = 0;
-	uint8_t ch = getch();
-	switch (ch)
+	if (!length)
+		return;
+
+	_spi.cmd = cmd;
+	_spi.toggle = toggle;
+	_spi.shift = toggle ? 1 : 0;
+	_spi.load = load;
+	_spi.address = address;
+	_spi.buff = buff;
+	_spi.length = length;
+	_spi.phase = 0;
+	_spi.count = 0;
+	_spi.busy = true;
+
+	// Loads are broadcast by the hardware, gang reads have to see every
+	// MISO. Neither can use it below SPI_CLOCK_DIV128.
+	bool bitbang = softClock();
+#if GANG_TARGETS > 1
+	bitbang |= gang() && !load;
+#endif
+	if (bitbang)
+	{
+		uint8_t in;
+		do
+		{
+			in = ispByte(spiNext());
+			if (_spi.phase == 3 && !load)
+				gangCheck(in);
+		} while (spiStep(in));
+		return;
+	}
+
+#if !LEAN
+	if (_sck_index >= SPI_IRQ_INDEX)
+	{
+		SPCR |= _BV(SPIE);
+		SPDR = spiNext();
+		return;
+	}
+
+	do
+	{
+		SPDR = spiNext();
+		while (!(SPSR & _BV(SPIF)))
+			;
+	} while (spiStep(SPDR));
+#endif
+}
+
+uint16_t spiCount()
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t count = _spi.count;
+	SREG = sreg;
+	return count;
+}
+
+uint8_t spiByte(uint8_t b)
+{
+#if LEAN
+	return softByte(b);
+#else
+	SPDR = b;
+	while (!(SPSR & _BV(SPIF)))
+		;
+	return SPDR;
+#endif
+}
+
+// a byte of an ISP instruction to every target in programming mode
+uint8_t ispByte(uint8_t b)
+{
+#if GANG_TARGETS > 1
+	if (gang())
+		return gangByte(b);
+#endif
+	if (softClock())
+		return softByte(b);
+	return spiByte(b);
+}
+
+uint8_t spiTransfer(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+	while (_spi.busy)
+		;
+
+	PHASE_BEGIN(PHASE_SPI);
+	ispByte(a);
+	ispByte(b);
+	ispByte(c);
+	uint8_t in = ispByte(d);
+	PHASE_END(PHASE_SPI, spi);
+	return in;
+}
+
+uint8_t spiTransfer(uint8_t a, uint16_t b, uint8_t c)
+{
+	return spiTransfer(a, highByte(b), lowByte(b), c);
+}
+
+// Flash beyond 64K words is reached through the Load Extended Address
+// byte, it is only sent when the 64K word segment changes.
+void loadExtendedAddress(uint32_t address)
+{
+	if (!TARGET_EXTENDED)
+		return;
+
+	uint8_t ext = address >> 16;
+
+	if (ext != _ext_addr)
+	{
+		spiTransfer(0x4D, 0x00, ext, 0x00);
+		_ext_addr = ext;
+	}
+}
+
+// Start reading the next chunk of a block into buff with the SPI engine
+// and return its length. Chunks are at most BUFF_LENGTH and flash chunks
+// stop at the 64K word boundary so the extended address can follow.
+uint16_t spiReadChunk(uint8_t cmd, uint8_t toggle, uint32_t address,
+		uint32_t length, uint8_t *buff = _buff)
+{
+	uint16_t chunk = length > BUFF_LENGTH ? BUFF_LENGTH : length;
+
+	if (toggle)
+	{
+		uint32_t left = (0x10000 - (address & 0xFFFF)) << 1;
+		if (chunk > left)
+			chunk = left;
+		loadExtendedAddress(address);
+	}
+
+	spiStart(cmd, toggle, false, address, buff, chunk);
+	return chunk;
+}
+
+#if READ_CACHE
+// Flash read by STK_READ_PAGE, in the halves of _pages. While a page goes
+// out to the host the engine reads the next one into the other half, which
+// is where a verify pass asks next. Page reads, 'U' and flash reads by 'V'
+// keep the cache, any other command drops it before touching the buffers.
+static struct
+{
+	uint32_t address; // word address
+	uint16_t length; // bytes, 0 if the half holds nothing
+} _cache[2];
+
+void cacheDrop()
+{
+	while (_spi.busy)
+		;
+	_cache[0].length = _cache[1].length = 0;
+}
+
+// the half holding length bytes from word address on, -1 if neither does
+int8_t cacheFind(uint32_t address, uint16_t length)
+{
+	for (uint8_t h = 0; h < 2; h++)
+		if (_cache[h].length && address >= _cache[h].address
+				&& (address - _cache[h].address) * 2 + length
+						<= _cache[h].length)
+			return h;
+	return -1;
+}
+#endif
+
+bool receiveEop()
+{
+	bool eop = getch() == CRC_EOP;
+
+	if (eop)
+		Serial.write(STK_INSYNC);
+	else
+	{
+		fault(FAULT_SYNC);
+		STAT_COUNT(nosync);
+		Serial.write(STK_NOSYNC);
+	}
+
+	return eop;
+}
+
+// the answer after CRC_EOP, STK_FAILED in place of STK_OK if not ok
+void reply(bool has_byte, byte val, bool send_ok, bool ok)
+{
+	if (!receiveEop())
+		return;
+
+	if (has_byte)
+		Serial.write(val);
+
+	if (send_ok)
+		Serial.write(ok ? STK_OK : STK_FAILED);
+}
+
+uint8_t sckDuration(uint8_t index = _sck_index)
+{
+	// SCK period of a clock step in STK500 units, rounded up. The unit is
+	// 8 cycles of STK500_XTAL, dividing first keeps it in 32 bits.
+	uint32_t divider = 2UL << index;
+	uint32_t duration = (divider * (STK500_XTAL / 8) + F_CPU - 1) / F_CPU;
+	return duration > 0xFF ? 0xFF : duration;
+}
+
+// the host asks for a SCK period of at least duration, 0 for the fastest
+void setSckDuration(uint8_t duration)
+{
+	_sck_first = 0;
+	while (_sck_first < SCK_STEPS - 1 && sckDuration(_sck_first) < duration)
+		_sck_first++;
+}
+
+// Vendor parameters, shared by the STK500v1 and v2 engines. The get returns
+// false for an unknown parameter, the set for one which can't be set to value.
+bool getVendorParameter(uint8_t parm, uint8_t &value)
+{
+	switch (parm)
+	{
+	case PARM_BAUD:
+		value = _baud;
+		return true;
+	case PARM_GANG_SELECT:
+		value = _gang_select;
+		return true;
+	case PARM_GANG_FAIL:
+		value = _gang_fail;
+		return true;
+	case PARM_DIFF:
+		value = _diff;
+		return true;
+	case PARM_DIFF_ERASE:
+		value = _diff_erase;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// a PARM_BAUD switch has to wait for the answer, so the caller does it
+bool setVendorParameter(uint8_t parm, uint8_t value)
+{
+	switch (parm)
+	{
+	case PARM_BAUD:
+		return value < BAUDS;
+#if GANG_TARGETS > 1
+	case PARM_GANG_SELECT:
+		if (!value || value >= _BV(GANG_TARGETS) || _programming)
+			return false;
+		_gang_select = value;
+		return true;
+#endif
+#if PAGE_BUFFERS > 1
+	case PARM_DIFF:
+		_diff = value;
+		return true;
+#endif
+	case PARM_DIFF_ERASE:
+		_diff_erase = value;
+		return true;
+	default:
+		return false;
+	}
+}
+
+void replyVersion(uint8_t c)
+{
+	uint8_t value;
+
+	switch (c)
+	{
+	case 0x80:
+		reply(true, HARDWARE_VERSION);
+		break;
+	case 0x81:
+		reply(true, FIRMWARE_MAJOR_VERSION);
+		break;
+	case 0x82:
+		reply(true, FIRMWARE_MINOR_VERSION);
+		break;
+	case PARM_SCK_DURATION:
+		reply(true, sckDuration());
+		break;
+	case 0x93:
+		reply(true, 'S'); // serial programmer
+		break;
+	default:
+		reply(true, getVendorParameter(c, value) ? value : 0x00);
+		break;
+	}
+}
+
+void setParameter(uint8_t parm, uint8_t value)
+{
+	if (!receiveEop())
+		return;
+
+	if (parm == PARM_SCK_DURATION)
+		setSckDuration(value);
+	else if (!setVendorParameter(parm, value))
+	{
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	Serial.write(STK_OK);
+	if (parm == PARM_BAUD)
+		setBaud(value);
+}
+
+void setParameters()
+{
+	// call this after reading paramter packet into buff[]: signature,
+	// revision, progtype, parmode, polling, selftimed, lock bytes, fuse
+	// bytes, flash poll (2), eeprom poll (2), page size (2), eeprom size (2),
+	// flash size (4)
+	_param.polling = _buff[4];
+	_param.flash_poll = _buff[8];
+
+	_param.eeprom_poll = makeWord(_buff[10], _buff[11]);
+	_param.flash_pagesize = makeWord(_buff[12], _buff[13]);
+	_param.eeprom_size = makeWord(_buff[14], _buff[15]);
+
+	// byte writes, see setExtParameters()
+	_param.eeprom_pagesize = 0;
+}
+
+void setExtParameters()
+{
+	// commandsize, eeprom page size, pagel, bs2, reset disable. The page size
+	// comes for parts without 0xC1/0xC2 too, an ATmega8 has 4, so it is not
+	// taken as page mode: only a v2 page mode message or a profile write pages
+	_param.eeprom_pagesize = 0;
+}
+
+// Returns the targets in _gang_active which are in sync.
+uint8_t enterProgrammingMode()
+{
+	// a positive pulse on RESET while SCK is low, then the
+	// Programming Enable instruction. In sync the target echoes 0x53 as the
+	// third byte. The pulse has to last two target clocks; at f/4 a half
+	// SCK period is two of them, so four are plenty. That is 0 on the fast
+	// steps, the two calls take longer than a clock there.
+	digitalWrite(ISP_SCK, LOW);
+	resetTargets(HIGH);
+	uint16_t pulse = 4 * sckHalf();
+	if (pulse)
+		delayMicroseconds(pulse);
+	resetTargets(LOW);
+
+	delay(20);
+
+	ispByte(0xAC);
+	ispByte(0x53);
+	uint8_t synced = targetsMatching(ispByte(0x00), 0x53);
+	ispByte(0x00);
+
+	// the echo alone may be a lucky bit pattern at a marginal clock rate,
+	// so the signature has to read back the same twice as well
+	for (uint8_t i = 0; synced && i < 3; i++)
+	{
+		uint8_t sig = spiTransfer(0x30, 0x00, i, 0x00);
+		synced &= targetsMatching(spiTransfer(0x30, 0x00, i, 0x00), sig);
+		if (i == 0 && (sig == 0x00 || sig == 0xFF))
+			synced = 0;
+	}
+
+	return synced;
+}
+
+// switch the SPI over to the clock step in use
+void setClock()
+{
+#if !LEAN
+	if (!softClock())
+		SPI.setClockDivider(_sck_dividers[_sck_index]);
+#endif
+}
+
+bool beginProgramming()
+{
+#if !LEAN
+	SPI.begin();
+#endif
+	softBegin();
+#if GANG_TARGETS > 1
+	gangBegin();
+#endif
+
+	_gang_active = _gang_select;
+	_gang_fail = 0;
+	resetTargets(HIGH);
+#if GANG_TARGETS > 1
+	for (uint8_t t = 0; t < GANG_TARGETS; t++)
+		if (_gang_active & _BV(t))
+			pinMode(_gang_reset_pins[t], OUTPUT);
+#else
+	pinMode(RESET, OUTPUT);
+#endif
+
+	uint8_t synced = 0;
+	uint8_t best = SCK_STEPS - 1; // fastest step the most targets synced at
+	uint8_t most = 0;
+	for (_sck_index = _sck_first; _sck_index < SCK_STEPS; _sck_index++)
+	{
+		setClock();
+		_gang_active = _gang_select;
+		synced = enterProgrammingMode();
+		if (synced == _gang_select)
+			break;
+
+		uint8_t count = 0;
+		for (uint8_t t = synced; t; t &= t - 1)
+			count++;
+		if (count > most)
+		{
+			most = count;
+			best = _sck_index;
+		}
+		STAT_COUNT(retries);
+	}
+
+	// nobody, or not every target, answered: carry on with the most targets
+	// at the fastest clock they took, a missing board would otherwise keep
+	// the panel at the slowest one. With none stay there for the universal
+	// commands.
+	if (_sck_index == SCK_STEPS)
+	{
+		_sck_index = best;
+		fault(FAULT_DEVICE);
+		if (most)
+		{
+			setClock();
+			_gang_active = _gang_select;
+			synced = enterProgrammingMode();
+		}
+		_gang_fail = _gang_select & ~synced;
+		_gang_active = _gang_fail;
+		resetTargets(HIGH);
+	}
+
+	// A sync at a step the host did not ask for is at the edge of what the
+	// target takes, a 16MHz part may answer at 8MHz where the datasheet
+	// allows 4MHz. Page data goes a step slower, within the hardware ones.
+	if (synced && (_sck_index > _sck_first || !_sck_first)
+			&& _sck_index < SCK_DIVIDERS - 1)
+	{
+		_sck_index++;
+		setClock();
+	}
+
+	_gang_active = synced;
+	if (!synced)
+		return false;
+
+	_programming = true;
+	setErased(false);
+	_ext_addr = 0;
+	return true;
+}
+
+void endProgramming()
+{
+	flushPage();
+#if !LEAN
+	SPI.end();
+#endif
+#if GANG_TARGETS > 1
+	for (uint8_t t = 0; t < GANG_TARGETS; t++)
+		if (_gang_select & _BV(t))
+		{
+			digitalWrite(_gang_reset_pins[t], HIGH);
+			pinMode(_gang_reset_pins[t], INPUT);
+		}
+#else
+	digitalWrite(RESET, HIGH);
+	pinMode(RESET, INPUT);
+#endif
+	_programming = false;
+}
+
+// Wait for a Chip Erase, RDY/BSY tells when it is done if the target has
+// it. Returns false on a timeout.
+bool eraseWait()
+{
+	bool ok = true;
+	PHASE_BEGIN(PHASE_POLL);
+	if (!_param.polling)
+		delay(ERASE_DELAY);
+	else
+	{
+		uint32_t start = millis();
+		while (ok && targetsMatching(spiTransfer(0xF0, 0x00, 0x00, 0x00),
+				0x00, 0x01) != _gang_active)
+		{
+			if (millis() - start > ERASE_TIMEOUT)
+			{
+				fault(FAULT_WRITE);
+				ok = false;
+			}
+		}
+	}
+	PHASE_END(PHASE_POLL, poll);
+	return ok;
+}
+
+bool chipErase()
+{
+	// a page which failed in the background goes with the erase
+	flushPage();
+	spiTransfer(0xAC, 0x80, 0x00, 0x00);
+	return setErased(eraseWait());
+}
+
+// STK_CHIP_ERASE: answers as soon as the target is ready again
+void erase()
+{
+	if (!receiveEop())
+		return;
+
+	Serial.write(chipErase() ? STK_OK : STK_FAILED);
+}
+
+// A fuse write at a bit-banged clock may have made the target faster, as
+// clearing CKDIV8 does. It takes effect on reset, so programming mode is
+// entered again from the fastest step and the rest of the session runs on
+// the hardware SPI. Returns false if the target is lost on the way,
+// programming mode is left then so nothing else is taken as written.
+bool retune()
+{
+	if (!softClock())
+		return true;
+	if (!waitReady(0x00, 0, 0xFF, 0xFF, 0xFF))
+		return false;
+
+	bool erased = _erased;
+	uint16_t pages = _resume.pages;
+	uint8_t first = _sck_first;
+	_sck_first = 0;
+	bool synced = beginProgramming();
+	_sck_first = first;
+	_erased = erased;
+	_resume.pages = pages;
+
+	if (!synced)
+		endProgramming();
+	return synced;
+}
+
+// The waits an instruction needs before the next one may go out, a chip
+// erase always, other writes if poll is set. Returns false on a timeout.
+bool instructionDone(const uint8_t *p, bool poll)
+{
+	if (p[0] == 0xAC && p[1] == 0x80)
+		return setErased(eraseWait());
+
+	bool ok = true;
+	if (poll && (p[0] == 0xAC || (p[0] & 0xFC) == 0xC0))
+		ok = waitReady(0x00, 0, 0xFF, 0xFF, 0xFF);
+
+	// a fuse write (0xACA0, 0xACA4, 0xACA8)
+	if (ok && p[0] == 0xAC && (p[1] & 0xF3) == 0xA0)
+		ok = retune();
+	return ok;
+}
+
+void universal(uint32_t &address)
+{
+	uint8_t ch;
+
+#if READ_CACHE
+	// the read ahead has to be in before fill() takes over _buff
+	while (_spi.busy)
+		;
+	_cache[_buff == _pages[1]].length = 0;
+#endif
+	fill(4);
+	// a page which failed in the background fails the next answer
+	bool ok = flushPage();
+
+	if (_buff[0] == 0x4D)
+	{
+		// keep the segment with the address, loaded when it is needed
+		address = (uint32_t) _buff[2] << 16 | (address & 0xFFFF);
+		loadExtendedAddress(address);
+		reply(true, 0x00, true, ok);
+		return;
+	}
+
+#if READ_CACHE
+	if ((_buff[0] & 0xF7) == 0x20)
+	{
+		uint32_t word = (address & 0xFF0000) | makeWord(_buff[1], _buff[2]);
+		int8_t half = cacheFind(word, 2);
+		if (half >= 0)
+		{
+			reply(true, _pages[half][(word - _cache[half].address) * 2
+					+ (_buff[0] >> 3 & 1)], true, ok);
+			return;
+		}
+	}
+	else
+		cacheDrop();
+#endif
+
+	ch = gangCheck(spiTransfer(_buff[0], _buff[1], _buff[2], _buff[3]));
+	ok = instructionDone(_buff, false) && ok;
+
+	reply(true, ch, true, ok);
+}
+
+// Run a list of ISP instructions back to back, for the fuse, lock,
+// signature and calibration checks which would take a 'V' round trip each.
+// The answer is the last byte of every instruction, then STK_OK or
+// STK_FAILED if a wait timed out.
+void batch()
+{
+	uint8_t count = getch();
+	uint8_t flags = getch();
+
+	if (count > BUFF_LENGTH / 4)
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	fill(count * 4);
+
+	if (!receiveEop())
+		return;
+
+	bool ok = flushPage();
+	for (uint8_t *p = _buff; count--; p += 4)
+	{
+		Serial.write(gangCheck(spiTransfer(p[0], p[1], p[2], p[3])));
+		if (p[0] == 0x4D)
+			_ext_addr = p[2];
+		ok = instructionDone(p, flags & BATCH_POLL) && ok;
+	}
+
+	Serial.write(ok ? STK_OK : STK_FAILED);
+}
+
+// A job holds what differs from board to board, fuses, serial numbers and
+// calibration, as a list of ISP instructions for each target, so a panel
+// is done in one command after the shared image went to all of it at once.
+// MOSI and SCK are shared and every target with RESET low takes every
+// instruction on them, so the targets of a job are taken one at a time:
+// only the one in hand has RESET held low, the others have it released and
+// run, deaf to ISP. Outside of programming mode only.
+uint8_t jobTarget(uint8_t target, const uint8_t *p, uint8_t count)
+{
+	uint8_t select = _gang_select;
+	uint8_t status = STK_NODEVICE;
+
+	_gang_select = _BV(target);
+	if (beginProgramming())
+	{
+		status = STK_OK;
+		for (; count--; p += 4)
+		{
+			spiTransfer(p[0], p[1], p[2], p[3]);
+			if (p[0] == 0x4D)
+				_ext_addr = p[2];
+			if (!instructionDone(p, true))
+				status = STK_FAILED;
+		}
+	}
+	endProgramming();
+	_gang_select = select;
+	return status;
+}
+
+// VND_JOB: the answer is the status of each record, STK_OK, STK_FAILED or
+// STK_NODEVICE, and the time it took in ms (2 bytes), then STK_OK
+void job()
+{
+	uint16_t length = getch() << 8;
+	length |= getch();
+
+	if (length > BUFF_LENGTH)
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	fill(length);
+
+	if (!receiveEop())
+		return;
+
+	// every record has to be whole before any target is touched
+	uint16_t i = 0;
+	while (i + 2 <= length && _buff[i] < GANG_TARGETS)
+		i += 2 + 4 * _buff[i + 1];
+	if (i != length || _programming)
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	// beginProgramming() starts _gang_fail over for each target
+	uint8_t failed = 0;
+	for (i = 0; i < length; i += 2 + 4 * _buff[i + 1])
+	{
+		uint32_t start = millis();
+		uint8_t status = jobTarget(_buff[i], _buff + i + 2, _buff[i + 1]);
+		uint16_t time = millis() - start;
+		if (status != STK_OK)
+			failed |= _BV(_buff[i]);
+		Serial.write(status);
+		Serial.write(highByte(time));
+		Serial.write(lowByte(time));
+	}
+	_gang_fail = failed;
+	Serial.write(STK_OK);
+}
+
+uint32_t getPage(uint32_t addr)
+{
+	return addr & ~((uint32_t) (FLASH_PAGESIZE >> 1) - 1);
+}
+
+// Check whether a self-timed write started at 'start' is still running.
+// With RDY/BSY polling supported (_param.polling) the busy flag is read with
+// 0xF0, otherwise the written byte is read back with read_cmd. A value
+// equal to one of the poll bytes can not be told apart from a busy target,
+// so then the worst case delay is used.
+bool writeBusy(uint8_t read_cmd, uint16_t addr, uint8_t value, uint8_t poll1,
+		uint8_t poll2, uint32_t start)
+{
+	// busy as long as any of the targets is
+	if (_param.polling)
+		return targetsMatching(spiTransfer(0xF0, 0x00, 0x00, 0x00), 0x00, 0x01)
+				!= _gang_active;
+
+	if (value == poll1 || value == poll2)
+		return millis() - start < WRITE_DELAY;
+
+	return targetsMatching(spiTransfer(read_cmd, addr, 0x00), value)
+			!= _gang_active;
+}
+
+bool waitReady(uint8_t read_cmd, uint16_t addr, uint8_t value, uint8_t poll1,
+		uint8_t poll2)
+{
+	uint32_t start = millis();
+	bool ok = true;
+
+	PHASE_BEGIN(PHASE_POLL);
+	while (ok && writeBusy(read_cmd, addr, value, poll1, poll2, start))
+	{
+		if (millis() - start > POLL_TIMEOUT)
+		{
+			fault(FAULT_WRITE);
+			ok = false;
+		}
+	}
+	PHASE_END(PHASE_POLL, poll);
+
+	return ok;
+}
+
+// The flash page handed over by writeFlash(). It is loaded by the SPI
+// engine, pageTask() commits it and polls for completion. The work
+// overlaps with receiving the next page into the other half of _pages.
+#define PAGE_IDLE		0
+#define PAGE_LOADING	1
+#define PAGE_COMMITTING	2
+
+static struct
+{
+	uint8_t state;
+	bool failed;
+	bool commit; // write the page once it is loaded
+	uint32_t address; // word address the load started at
+	uint16_t poll; // byte offset used for value polling
+	uint8_t value; // the byte there, the buffer may be refilled by then
+	uint32_t start;
+} _page;
+
+void pageTask()
+{
+	switch (_page.state)
+	{
+	case PAGE_LOADING:
+		if (!_spi.busy && !_page.commit)
+			_page.state = PAGE_IDLE;
+		else if (!_spi.busy)
+		{
+			loadExtendedAddress(_page.address);
+			spiTransfer(0x4C, (uint16_t) getPage(_page.address), 0);
+			_page.start = millis();
+			_page.state = PAGE_COMMITTING;
+		}
+		break;
+	case PAGE_COMMITTING:
+		if (!writeBusy(_page.poll & 1 ? 0x28 : 0x20,
+				(uint16_t) _page.address + (_page.poll >> 1), _page.value,
+				_param.flash_poll, _param.flash_poll, _page.start))
+		{
+			_resume.pages++;
+			_resume.address = _page.address;
+			_page.state = PAGE_IDLE;
+		}
+		else if (millis() - _page.start > POLL_TIMEOUT)
+		{
+			fault(FAULT_WRITE);
+			_page.failed = true;
+			_page.state = PAGE_IDLE;
+		}
+		break;
+	}
+}
+
+// Run the pending page to completion. Returns false if it failed, the
+// failure is reported once.
+bool flushPage()
+{
+	if (_page.state != PAGE_IDLE)
+	{
+		PHASE_BEGIN(PHASE_POLL);
+		while (_page.state != PAGE_IDLE)
+			pageTask();
+		PHASE_END(PHASE_POLL, poll);
+	}
+
+	bool ok = !_page.failed;
+	_page.failed = false;
+	return ok;
+}
+
+// Hand _buff over to the page task to be loaded from word address on, the
+// page is written at the end if commit is set.
+void queuePage(uint32_t address, uint16_t length, bool commit = true)
+{
+	// value polling needs a byte of the page which differs from flash_poll
+	uint16_t i = 0;
+	while (i + 1 < length && _buff[i] == _param.flash_poll)
+		i++;
+
+	uint8_t *buff = _buff;
+	_page.address = address;
+	_page.commit = commit;
+	_page.poll = i;
+	_page.value = _buff[i];
+	_page.state = length ? PAGE_LOADING : PAGE_IDLE;
+	if (length && commit)
+	{
+		STAT_COUNT(pages);
+#if LED_TIMER
+		_led_pages++;
+#endif
+	}
+
+#if PAGE_BUFFERS > 1
+	_buff = _buff == _pages[0] ? _pages[1] : _pages[0];
+#endif
+
+	spiStart(0x40, 0x08, true, (uint16_t) address, buff, length);
+}
+
+bool blank(const uint8_t *p, uint16_t length)
+{
+	while (length--)
+		if (*p++ != 0xFF)
+			return false;
+	return true;
+}
+
+// an erased page already reads 0xFF, nothing to load or commit
+bool skipPage(const uint8_t *p, uint16_t length)
+{
+	if (!_erased || !blank(p, length))
+		return false;
+	STAT_COUNT(skipped);
+	return true;
+}
+
+// Differential flashing (PARM_DIFF): before a page is written without a
+// chip erase it is compared with what the target holds. The pending page
+// has to be flushed first, the other half of _pages takes the read. With
+// one buffer there is no room for it and PARM_DIFF can't be set.
+#define DIFF_SAME	0
+#define DIFF_WRITE	1
+#define DIFF_ERASE	2
+
+uint8_t diffPage(uint32_t address, uint16_t length)
+{
+#if PAGE_BUFFERS > 1
+	if (!_diff || _erased)
+		return DIFF_WRITE;
+
+	uint8_t *old = _buff == _pages[0] ? _pages[1] : _pages[0];
+	spiReadChunk(0x20, 0x08, address, length, old);
+	while (_spi.busy)
+		;
+
+	uint8_t diff = DIFF_SAME;
+	for (uint16_t i = 0; i < length; i++)
+	{
+		// a page write only clears bits, there is no page erase over ISP
+		if (_buff[i] & ~old[i])
+		{
+			if (_diff_erase < 0xFF)
+				_diff_erase++;
+			_error = true;
+			return DIFF_ERASE;
+		}
+		if (_buff[i] != old[i])
+			diff = DIFF_WRITE;
+	}
+
+	if (diff == DIFF_SAME)
+		STAT_COUNT(skipped);
+	return diff;
+#else
+	(void) address;
+	(void) length;
+	return DIFF_WRITE;
+#endif
+}
+
+// write the flash page in _buff and answer, STK_INSYNC is out already
+void flashPage(uint32_t address, uint16_t length)
+{
+	if (skipPage(_buff, length))
+	{
+		Serial.write(STK_OK);
+		return;
+	}
+
+	// the previous page has been loading while this one came in
+	if (!flushPage())
+	{
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	uint8_t diff = diffPage(address, length);
+	if (diff != DIFF_WRITE)
+	{
+		Serial.write(diff == DIFF_SAME ? STK_OK : STK_FAILED);
+		return;
+	}
+
+	// the page is safe in _pages now, let the host send the next one
+#if PAGE_BUFFERS > 1
+	Serial.write(STK_OK);
+	queuePage(getPage(address), length);
+#else
+	queuePage(getPage(address), length);
+	Serial.write(STK_OK);
+#endif
+}
+
+void writeFlash(uint32_t address, uint16_t length)
+{
+	if (length > FLASH_PAGESIZE || length > BUFF_LENGTH)
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	fill(length);
+
+	if (!receiveEop())
+		return;
+
+	flashPage(address, length);
+}
+
+// write length bytes from _buff to the EEPROM from byte address addr
+bool programEeprom(uint16_t addr, uint16_t length)
+{
+	uint8_t * p = _buff;
+	uint8_t page = EEPROM_PAGESIZE;
+
+	if (page < 2 || (page & (page - 1)))
+	{
+		for (uint16_t i = length; i--; addr++, p++)
+		{
+			spiTransfer(0xC0, addr, *p);
+			if (!waitReady(0xA0, addr, *p, highByte(_param.eeprom_poll),
+					lowByte(_param.eeprom_poll)))
+				return false;
+		}
+		return true;
+	}
+
+	// page mode: load the bytes up to the end of a page (0xC1), write the
+	// page (0xC2) and wait once for it, polling the last byte loaded
+	uint8_t mask = page - 1;
+	while (length)
+	{
+		uint16_t start = addr & ~mask;
+		do
+		{
+			spiTransfer(0xC1, 0x00, addr & mask, *p);
+			addr++;
+			p++;
+			length--;
+		} while (length && (addr & mask));
+
+		spiTransfer(0xC2, start, 0x00);
+		if (!waitReady(0xA0, addr - 1, p[-1], highByte(_param.eeprom_poll),
+				lowByte(_param.eeprom_poll)))
+			return false;
+	}
+	return true;
+}
+
+// write _buff to the EEPROM from word address on and answer
+void eepromPage(uint16_t address, uint16_t length)
+{
+	if (!flushPage())
+	{
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	Serial.write(programEeprom(address << 1, length) ? STK_OK : STK_FAILED);
+}
+
+void writeEeprom(uint16_t address, uint16_t length)
+{
+	// all of it is taken in before the first write, the core's receive
+	// buffer would overrun while the target is busy
+	if (length > EEPROM_SIZE || length > BUFF_LENGTH)
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	fill(length);
+
+	if (!receiveEop())
+		return;
+
+	eepromPage(address, length);
+}
+
+// Unpack packed bytes of PackBits from the host into _buff: a control byte
+// n below 0x80 is followed by n + 1 bytes to copy, one above by a byte to
+// repeat 257 - n times, 0x80 is left out. False unless it comes to length.
+bool unpack(uint16_t packed, uint16_t length)
+{
+	uint16_t out = 0;
+	bool ok = true;
+
+	while (packed--)
+	{
+		uint8_t n = getch();
+		if (n == 0x80)
+			continue;
+
+		bool copy = n < 0x80;
+		uint16_t run = copy ? n + 1 : 257 - n;
+		uint8_t b = 0;
+		if (!copy && packed)
+		{
+			packed--;
+			b = getch();
+		}
+		else if (!copy)
+			ok = false;
+
+		while (ok && run--)
+		{
+			if (copy)
+			{
+				if (!packed)
+				{
+					ok = false;
+					break;
+				}
+				packed--;
+				b = getch();
+			}
+			if (out < length && out < BUFF_LENGTH)
+				_buff[out++] = b;
+			else
+				ok = false;
+		}
+	}
+
+	return ok && out == length;
+}
+
+// STK_PROG_PAGE with the data packed, the padding and repeated tables of a
+// firmware image take a fraction of the serial time
+void packedWrite(uint32_t address)
+{
+	uint8_t memtype = getch();
+	uint16_t length = getch() << 8;
+	length |= getch();
+	uint16_t packed = getch() << 8;
+	packed |= getch();
+
+	bool ok = unpack(packed, length);
+
+	if (!receiveEop())
+		return;
+
+	if (memtype == 'F' && ok && length <= FLASH_PAGESIZE)
+		flashPage(address, length);
+	else if (memtype == 'E' && ok && length <= EEPROM_SIZE)
+		eepromPage((uint16_t) address, length);
+	else
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+	}
+}
+
+void writeLong(uint32_t value)
+{
+	for (uint8_t i = 4; i--;)
+		Serial.write(value >> (i * 8));
+}
+
+// Serial numbers: every board gets the same image, then a number of its own
+// patched in, width bytes big endian at a byte address of the EEPROM or
+// flash, and the number counts up. The setting lives in the programmer's
+// EEPROM, so a standalone programmer carries on after a power cycle. A
+// flash patch has to land on bytes the image leaves blank, a page write
+// only clears bits.
+#define SERIAL_NUMBER_EEPROM	0 // where the setting is kept
+#define SERIAL_NUMBER_SLOTS		16 // EEPROM cells the count is spread over
+
+static struct
+{
+	uint8_t memtype; // 'F', 'E', anything else is off
+	uint8_t width; // 1 to 4
+	uint32_t address; // byte address
+	uint32_t number; // the next one to go out
+} _serial_number;
+
+// A cell takes about 100k writes, so the count does not go to the same one
+// for every board. It goes round a ring of SERIAL_NUMBER_SLOTS following the
+// setting, number n in slot n % SERIAL_NUMBER_SLOTS, and the next number is
+// the one no slot follows up on.
+#define SERIAL_NUMBER_RING	(SERIAL_NUMBER_EEPROM + sizeof(_serial_number))
+
+uint32_t serialNumberSlot(uint8_t i)
+{
+	uint32_t number;
+	eeprom_read_block(&number, (const void *) (SERIAL_NUMBER_RING
+			+ (i % SERIAL_NUMBER_SLOTS) * sizeof(number)), sizeof(number));
+	return number;
+}
+
+void serialNumberCount(uint32_t number)
+{
+	eeprom_update_block(&number, (void *) (SERIAL_NUMBER_RING
+			+ (number % SERIAL_NUMBER_SLOTS) * sizeof(number)), sizeof(number));
+}
+
+void serialNumberLoad()
+{
+	eeprom_read_block(&_serial_number, (const void *) SERIAL_NUMBER_EEPROM,
+			sizeof(_serial_number));
+
+	// a slot a power cut left half written follows up on neither neighbour,
+	// the one before it is still taken
+	for (uint8_t i = 0; i < SERIAL_NUMBER_SLOTS; i++)
+	{
+		uint32_t number = serialNumberSlot(i);
+		if (number % SERIAL_NUMBER_SLOTS == i
+				&& serialNumberSlot(i + SERIAL_NUMBER_SLOTS - 1) == number - 1
+				&& serialNumberSlot(i + 1) != number + 1)
+		{
+			_serial_number.number = number;
+			break;
+		}
+	}
+}
+
+// the setting, with the ring filled up to the number set
+void serialNumberSave()
+{
+	eeprom_update_block(&_serial_number, (void *) SERIAL_NUMBER_EEPROM,
+			sizeof(_serial_number));
+	for (uint8_t i = SERIAL_NUMBER_SLOTS; i--;)
+		serialNumberCount(_serial_number.number - i);
+}
+
+bool serialNumberValid(uint8_t memtype, uint8_t width)
+{
+	return (memtype == 'F' || memtype == 'E') && width && width <= 4;
+}
+
+bool serialNumberOn()
+{
+	return serialNumberValid(_serial_number.memtype, _serial_number.width);
+}
+
+// write the length bytes at the start of _buff where the serial number
+// goes, a flash patch is padded to its page with 0xFF
+bool patch(uint8_t length)
+{
+	uint32_t address = _serial_number.address;
+
+	if (!_programming)
+		return false;
+#if GANG_TARGETS > 1
+	// one number for every board is no serial number, see VND_JOB
+	if (gang())
+		return false;
+#endif
+
+	if (_serial_number.memtype == 'E')
+		return address + length <= EEPROM_SIZE
+				&& programEeprom((uint16_t) address, length);
+
+	uint16_t pagesize = FLASH_PAGESIZE;
+	uint16_t offset = address & (pagesize - 1);
+	if (!pagesize || pagesize > BUFF_LENGTH || offset + length > pagesize
+			|| !flushPage())
+		return false;
+
+	memmove(_buff + offset, _buff, length);
+	memset(_buff, 0xFF, offset);
+	memset(_buff + offset + length, 0xFF, pagesize - offset - length);
+	queuePage(getPage(address >> 1), pagesize);
+	return flushPage();
+}
+
+// patch in the next serial number and count up, a number which may have
+// reached the board is never handed out again
+bool serialNumberWrite()
+{
+	uint8_t width = _serial_number.width;
+	for (uint8_t i = 0; i < width; i++)
+		_buff[i] = _serial_number.number >> ((width - 1 - i) * 8);
+
+	// counted before the patch, a power cut in between loses a number
+	if (_programming)
+		serialNumberCount(++_serial_number.number);
+	return patch(width);
+}
+
+// VND_SERIAL_NUMBER: where the numbers go and the next one, memtype 0
+// turns them off
+void setSerialNumber()
+{
+	fill(10);
+
+	if (!receiveEop())
+		return;
+
+	// a setting that can't be used leaves the stored one as it is
+	if (_buff[0] && !serialNumberValid(_buff[0], _buff[5]))
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	_serial_number.memtype = _buff[0];
+	_serial_number.address = 0;
+	_serial_number.width = _buff[5];
+	_serial_number.number = 0;
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		_serial_number.address = _serial_number.address << 8 | _buff[1 + i];
+		_serial_number.number = _serial_number.number << 8 | _buff[6 + i];
+	}
+	serialNumberSave();
+
+	Serial.write(STK_OK);
+}
+
+// VND_INJECT: with no data the next serial number goes in, otherwise the
+// data the host made for this board does, at the same place. The answer is
+// the next serial number (4 bytes, big endian), then STK_OK or STK_FAILED.
+void inject()
+{
+	uint8_t length = getch();
+
+#if BUFF_LENGTH < 0x100
+	if (length > BUFF_LENGTH)
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+		return;
+	}
+#endif
+
+	fill(length);
+
+	if (!receiveEop())
+		return;
+
+	bool ok = serialNumberOn() && (length ? patch(length) : serialNumberWrite());
+	if (!ok)
+		_error = true;
+
+	writeLong(_serial_number.number);
+	Serial.write(ok ? STK_OK : STK_FAILED);
+}
+
+// Write count pages of length bytes from the 'U' address on with a single
+// command. Pages follow back to back without framing, paced by the credits.
+// Every page is taken in even after a failure so the stream stays in step,
+// the answer is STK_OK or STK_FAILED and the index of the first page that
+// failed.
+void streamWrite(uint32_t &address)
+{
+	uint8_t memtype = getch();
+	uint16_t count = getch() << 8;
+	count |= getch();
+	uint16_t length = getch() << 8;
+	length |= getch();
+
+	if (!receiveEop())
+		return;
+
+	// the whole of an EEPROM stream has to fit, its address would wrap
+	bool flash = memtype == 'F';
+	uint16_t eeprom = address << 1;
+	if ((!flash && memtype != 'E') || !length || length > BUFF_LENGTH
+			|| (flash && length > FLASH_PAGESIZE)
+			|| (!flash && eeprom + (uint32_t) count * length > EEPROM_SIZE))
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	for (uint16_t i = 0; i < STREAM_WINDOW && i < count; i++)
+		Serial.write(STREAM_CREDIT);
+
+	uint16_t failed = count; // none
+	uint16_t queued = 0;
+	for (uint16_t i = 0; i < count; i++)
+	{
+		fill(length);
+
+		// the host is gone, don't program what never came
+		if (_rx_lost)
+		{
+			if (failed == count)
+				failed = i;
+			break;
+		}
+
+		if (failed == count)
+		{
+			// a failure shows on the page after the one queued
+			if (!flushPage())
+				failed = queued;
+			else if (!flash)
+			{
+				if (!programEeprom(eeprom, length))
+					failed = i;
+			}
+			else if (!skipPage(_buff, length))
+			{
+				uint8_t diff = diffPage(address, length);
+				if (diff == DIFF_ERASE)
+					failed = i;
+				else if (diff == DIFF_WRITE)
+				{
+					queuePage(getPage(address), length);
+					queued = i;
+				}
+			}
+		}
+
+		if (i + STREAM_WINDOW < count)
+			Serial.write(STREAM_CREDIT);
+
+		if (flash)
+			address += length >> 1;
+		else
+			eeprom += length;
+	}
+
+	if (!flushPage() && failed == count)
+		failed = queued;
+	if (!flash)
+		address = eeprom >> 1;
+
+	if (failed == count)
+		Serial.write(STK_OK);
+	else
+	{
+		_error = true;
+		Serial.write(STK_FAILED);
+		Serial.write(highByte(failed));
+		Serial.write(lowByte(failed));
+	}
+}
+
+void programPage(uint32_t address)
+{
+	uint16_t length = (getch() << 8) | getch(); // It is weird that makeWord does not work here
+	uint8_t memtype = getch();
+
+	switch (memtype)
+	{
+	case 'F':
+		writeFlash(address, length);
+		break;
+	case 'E':
+		writeEeprom((uint16_t) address, length);
+		break;
+	default:
+		Serial.write(STK_FAILED);
+		break;
+	}
+}
+
+void spiWaitFor(uint16_t i)
+{
+	while (spiCount() <= i && _spi.busy)
+		;
+}
+
+// Read a block, each byte goes out to the host as soon as the engine has it.
+// The two page buffers make a ring: once a chunk is in, the engine goes on
+// with the next one in the other half while the serial line drains it. The
+// answer ends in STK_FAILED if not ok.
+void spiRead(uint8_t cmd, uint8_t toggle, uint32_t address, uint32_t length,
+		bool ok = true)
+{
+	uint8_t half = 0;
+	uint16_t chunk = spiReadChunk(cmd, toggle, address, length, _pages[0]);
+
+	while (chunk)
+	{
+		const uint8_t *p = _pages[half];
+		uint16_t next = 0;
+
+		address += toggle ? chunk >> 1 : chunk;
+		length -= chunk;
+#if PAGE_BUFFERS > 1
+		half ^= 1;
+#endif
+
+		for (uint16_t i = 0; i < chunk; i++)
+		{
+			if (!next && PAGE_BUFFERS > 1)
+			{
+				spiWaitFor(i);
+				if (length && !_spi.busy)
+					next = spiReadChunk(cmd, toggle, address, length,
+							_pages[half]);
+			}
+			Serial.write(p[i]);
+		}
+
+		// with one buffer the next chunk waits for this one to go out
+		if (PAGE_BUFFERS == 1 && length)
+			next = spiReadChunk(cmd, toggle, address, length, _pages[0]);
+		chunk = next;
+	}
+	Serial.write(ok ? STK_OK : STK_FAILED);
+}
+
+// CRC-16/CCITT-FALSE, poly 0x1021 and init 0xFFFF (binascii.crc_hqx)
+uint16_t crc16Update(uint16_t crc, uint8_t b)
+{
+	crc ^= (uint16_t) b << 8;
+	for (uint8_t i = 0; i < 8; i++)
+		crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	return crc;
+}
+
+uint16_t spiChecksum(uint8_t cmd, uint8_t toggle, uint32_t address,
+		uint16_t length, uint16_t crc = 0xFFFF)
+{
+	while (length)
+	{
+		uint16_t chunk = spiReadChunk(cmd, toggle, address, length);
+
+		for (uint16_t i = 0; i < chunk; i++)
+		{
+			spiWaitFor(i);
+			crc = crc16Update(crc, _buff[i]);
+		}
+
+		address += toggle ? chunk >> 1 : chunk;
+		length -= chunk;
+	}
+	return crc;
+}
+
+// Verify a block on the programmer: the target is read over SPI and only
+// the CRC goes back, followed by STK_OK when it matches the expected one.
+// Starts at the 'U' address like STK_READ_PAGE.
+void checksum(uint32_t address)
+{
+	uint16_t length = getch() << 8;
+	length |= getch();
+	uint8_t memtype = getch();
+	uint16_t expected = getch() << 8;
+	expected |= getch();
+
+	if (!receiveEop())
+		return;
+
+	bool ok = flushPage();
+
+	uint16_t crc;
+	switch (memtype)
+	{
+	case 'F':
+		crc = spiChecksum(0x20, 0x08, address, length);
+		break;
+	case 'E':
+		crc = spiChecksum(0xA0, 0x00, (uint16_t) address * 2, length);
+		break;
+	default:
+		Serial.write(STK_FAILED);
+		return;
+	}
+
+	Serial.write(highByte(crc));
+	Serial.write(lowByte(crc));
+	Serial.write(ok && crc == expected ? STK_OK : STK_FAILED);
+}
+
+#if READ_CACHE
+// only the latest read ahead may still be coming in
+void cacheWaitFor(uint8_t half, uint16_t i)
+{
+	if (_spi.buff == _pages[half])
+		spiWaitFor(i);
+}
+
+void readFlashPage(uint32_t address, uint16_t length, bool ok)
+{
+	int8_t half = cacheFind(address, length);
+
+	if (half < 0)
+	{
+		// more than a half holds goes the long way
+		if (length > BUFF_LENGTH
+				|| length > (0x10000 - (address & 0xFFFF)) << 1)
+		{
+			cacheDrop();
+			spiRead(0x20, 0x08, address, length, ok);
+			return;
+		}
+		cacheDrop();
+		half = 0;
+		_cache[0].address = address;
+		_cache[0].length = spiReadChunk(0x20, 0x08, address, length,
+				_pages[0]);
+	}
+
+	uint16_t offset = (address - _cache[half].address) * 2;
+	uint32_t next = address + (length >> 1);
+	bool ahead = cacheFind(next, length) >= 0;
+
+	for (uint16_t i = 0; i < length; i++)
+	{
+		// the half may still be coming in, next may be cached further on in
+		// it when the host reads less than a chunk
+		cacheWaitFor(half, offset + i);
+		if (!ahead && !_spi.busy)
+		{
+			uint8_t other = half ^ 1;
+			_cache[other].address = next;
+			_cache[other].length = spiReadChunk(0x20, 0x08, next, length,
+					_pages[other]);
+			ahead = true;
+		}
+		Serial.write(_pages[half][offset + i]);
+	}
+	Serial.write(ok ? STK_OK : STK_FAILED);
+}
+#else
+void readFlashPage(uint32_t address, uint16_t length, bool ok)
+{
+	spiRead(0x20, 0x08, address, length, ok);
+}
+#endif
+
+void readEepromPage(uint16_t address, uint16_t length, bool ok)
+{
+	// here again we have a word address
+	spiRead(0xA0, 0x00, address * 2, length, ok);
+}
+
+void readPage(uint32_t address)
+{
+	uint16_t length = (getch() << 8) | getch();
+
+	uint8_t memtype = getch();
+
+	if (!receiveEop())
+		return;
+
+	bool ok = flushPage();
+
+	switch (memtype)
+	{
+	case 'F':
+		readFlashPage(address, length, ok);
+		break;
+	case 'E':
+#if READ_CACHE
+		cacheDrop();
+#endif
+		readEepromPage((uint16_t) address, length, ok);
+		break;
+	default:
+		Serial.write(STK_FAILED);
+		break;
+	}
+}
+
+// Dump a region of any length from the 'U' address in one command, for
+// backups and audits where a page per round trip would leave the line idle.
+void dump(uint32_t address)
+{
+	uint8_t memtype = getch();
+	uint32_t length = 0;
+	for (uint8_t i = 0; i < 4; i++)
+		length = (length << 8) | getch();
+
+	if (!receiveEop())
+		return;
+
+	bool ok = flushPage();
+
+	switch (memtype)
+	{
+	case 'F':
+		spiRead(0x20, 0x08, address, length, ok);
+		break;
+	case 'E':
+		spiRead(0xA0, 0x00, (uint16_t) address * 2, length, ok);
+		break;
+	default:
+		Serial.write(STK_FAILED);
+		break;
+	}
+}
+
+#if STATS
+// VND_STATS: serial, SPI and poll times (4 bytes each, us), then pages,
+// skipped, nosync and retries (2 bytes each), all big endian
+void stats()
+{
+	uint8_t clear = getch();
+
+	if (!receiveEop())
+		return;
+
+	writeLong(_stats.serial);
+	writeLong(_stats.spi);
+	writeLong(_stats.poll);
+	const uint16_t counts[] =
+	{ _stats.pages, _stats.skipped, _stats.nosync, _stats.retries };
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		Serial.write(highByte(counts[i]));
+		Serial.write(lowByte(counts[i]));
+	}
+	Serial.write(STK_OK);
+
+	if (clear)
+		memset(&_stats, 0, sizeof(_stats));
+}
+#endif
+
+// VND_RESUME: the state (RESUME_*), the flash pages written (2 bytes) and
+// the word address of the last one (4 bytes), big endian. The pending page
+// is finished first, the answer only counts pages which made it.
+void resume()
+{
+	if (!receiveEop())
+		return;
+
+	bool ok = flushPage();
+	Serial.write((_programming ? RESUME_PROGRAMMING : 0)
+			| (_erased ? RESUME_ERASED : 0));
+	Serial.write(highByte(_resume.pages));
+	Serial.write(lowByte(_resume.pages));
+	writeLong(_resume.address);
+	Serial.write(ok ? STK_OK : STK_FAILED);
+}
+
+void readSignature()
+{
+	if (!receiveEop())
+		return;
+
+	bool ok = flushPage();
+
+	Serial.write(gangCheck(spiTransfer(0x30, 0x00, 0x00, 0x00)));
+	Serial.write(gangCheck(spiTransfer(0x30, 0x00, 0x01, 0x00)));
+	Serial.write(gangCheck(spiTransfer(0x30, 0x00, 0x02, 0x00)));
+
+	Serial.write(ok ? STK_OK : STK_FAILED);
+}
+
+#if STK500V2
+// STK500v2 commands
+#define CMD_SIGN_ON					0x01
+#define CMD_SET_PARAMETER			0x02
+#define CMD_GET_PARAMETER			0x03
+#define CMD_LOAD_ADDRESS			0x06
+#define CMD_ENTER_PROGMODE_ISP		0x10
+#define CMD_LEAVE_PROGMODE_ISP		0x11
+#define CMD_CHIP_ERASE_ISP			0x12
+#define CMD_PROGRAM_FLASH_ISP		0x13
+#define CMD_READ_FLASH_ISP			0x14
+#define CMD_PROGRAM_EEPROM_ISP		0x15
+#define CMD_READ_EEPROM_ISP			0x16
+#define CMD_PROGRAM_FUSE_ISP		0x17
+#define CMD_READ_FUSE_ISP			0x18
+#define CMD_PROGRAM_LOCK_ISP		0x19
+#define CMD_READ_LOCK_ISP			0x1A
+#define CMD_READ_SIGNATURE_ISP		0x1B
+#define CMD_READ_OSCCAL_ISP			0x1C
+#define CMD_SPI_MULTI				0x1D
+
+#define STATUS_CMD_OK				0x00
+#define STATUS_CMD_TOUT				0x80
+#define STATUS_RDY_BSY_TOUT			0x81
+#define STATUS_CMD_FAILED			0xC0
+#define STATUS_CKSUM_ERROR			0xC1
+#define STATUS_CMD_UNKNOWN			0xC9
+#define ANSWER_CKSUM_ERROR			0xB0
+
+#define PARAM_BUILD_NUMBER_LOW		0x80
+#define PARAM_BUILD_NUMBER_HIGH		0x81
+#define PARAM_HW_VER				0x90
+#define PARAM_SW_MAJOR				0x91
+#define PARAM_SW_MINOR				0x92
+#define PARAM_VTARGET				0x94
+#define PARAM_SCK_DURATION			0x98
+#define PARAM_TOPCARD_DETECT		0x9A
+
+// The first V2_HEAD bytes of a message body are kept apart, the rest (the
+// data of CMD_PROGRAM_*_ISP) lands in _buff. That gives bodies of up to
+// 266 bytes, a 256 byte page with its header.
+#define V2_HEAD 10
+#define V2_BODY (V2_HEAD + BUFF_LENGTH)
+
+static uint8_t _v2_head[V2_HEAD];
+static uint8_t _v2_sum;
+static uint8_t _v2_seq;
+static uint32_t _v2_address; // word address for flash, byte address for EEPROM
+
+uint8_t v2Body(uint16_t i)
+{
+	return i < V2_HEAD ? _v2_head[i] : _buff[i - V2_HEAD];
+}
+
+void v2Byte(uint8_t b)
+{
+	_v2_sum ^= b;
+	Serial.write(b);
+}
+
+void v2Begin(uint16_t size, uint8_t cmd, uint8_t status)
+{
+	_v2_sum = 0;
+	v2Byte(MESSAGE_START);
+	v2Byte(_v2_seq);
+	v2Byte(highByte(size));
+	v2Byte(lowByte(size));
+	v2Byte(TOKEN);
+	v2Byte(cmd);
+	v2Byte(status);
+}
+
+void v2End()
+{
+	Serial.write(_v2_sum);
+}
+
+void v2Answer(uint8_t cmd, uint8_t status)
+{
+	v2Begin(2, cmd, status);
+	v2End();
+}
+
+void v2AnswerByte(uint8_t cmd, uint8_t value)
+{
+	v2Begin(4, cmd, STATUS_CMD_OK);
+	v2Byte(value);
+	v2Byte(STATUS_CMD_OK);
+	v2End();
+}
+
+// cmd1, mode, poll1 and poll2 as used by CMD_PROGRAM_*_ISP
+uint8_t v2Program(bool flash, uint16_t size)
+{
+	uint16_t length = makeWord(_v2_head[1], _v2_head[2]);
+	uint8_t mode = _v2_head[3];
+	uint8_t cmd1 = _v2_head[5];
+	uint8_t cmd3 = _v2_head[7];
+	uint8_t poll1 = _v2_head[8];
+	uint8_t poll2 = _v2_head[9];
+
+	if (size < V2_HEAD || length > size - V2_HEAD)
+		return STATUS_CMD_FAILED;
+
+	// the write mode of the message drives the polling of waitReady() and
+	// the page task: bit 0 selects page mode, then 3 bits each for word and
+	// page mode of timed delay, value polling, RDY/BSY polling
+	uint8_t method = mode & 0x01 ? mode >> 4 : mode >> 1;
+	_param.polling = method & 0x04;
+	if (flash)
+		_param.flash_poll = poll1;
+	else
+		_param.eeprom_poll = makeWord(poll1, poll2);
+
+	if (!flushPage())
+		return _param.polling ? STATUS_RDY_BSY_TOUT : STATUS_CMD_TOUT;
+
+	bool ok = true;
+	if (!flash)
+	{
+		// a page mode message holds one EEPROM page
+		_param.eeprom_pagesize = mode & 0x01 && length < 0x100 ? length : 0;
+		ok = programEeprom(_v2_address, length);
+	}
+	else if (mode & 0x01)
+	{
+		// page mode, the answer goes out while the page loads. There is no
+		// 'B' in a v2 session, a message that commits holds a whole page and
+		// gives its size, getPage() needs it for the commit.
+		bool commit = mode & 0x80;
+		if (commit)
+			_param.flash_pagesize = length;
+		if (!(commit && skipPage(_buff, length)))
+			queuePage(_v2_address, length, commit);
+	}
+	else
+	{
+		loadExtendedAddress(_v2_address);
+		for (uint16_t i = 0; ok && i < length; i++)
+		{
+			uint16_t addr = _v2_address + (i >> 1);
+			uint8_t high = i & 1 ? 0x08 : 0x00;
+			spiTransfer(cmd1 | high, addr, _buff[i]);
+			ok = waitReady(cmd3 | high, addr, _buff[i], poll1, poll2);
+		}
+	}
+
+	_v2_address += flash ? length >> 1 : length;
+
+	if (!ok)
+		return _param.polling ? STATUS_RDY_BSY_TOUT : STATUS_CMD_TOUT;
+	return STATUS_CMD_OK;
+}
+
+void v2Read(uint8_t cmd, bool flash)
+{
+	uint16_t length = makeWord(_v2_head[1], _v2_head[2]);
+	uint8_t toggle = flash ? 0x08 : 0x00;
+
+	v2Begin(length + 3, cmd, STATUS_CMD_OK);
+	while (length)
+	{
+		uint16_t chunk = spiReadChunk(_v2_head[3], toggle, _v2_address, length);
+
+		for (uint16_t i = 0; i < chunk; i++)
+		{
+			spiWaitFor(i);
+			v2Byte(_buff[i]);
+		}
+
+		_v2_address += flash ? chunk >> 1 : chunk;
+		length -= chunk;
+	}
+	v2Byte(STATUS_CMD_OK);
+	v2End();
+}
+
+// an ISP instruction from the message body, returns byte ret (1..4)
+uint8_t v2Instruction(uint8_t offset, uint8_t ret)
+{
+	uint8_t value = 0;
+
+	while (_spi.busy)
+		;
+	for (uint8_t i = 1; i <= 4; i++)
+	{
+		uint8_t b = ispByte(v2Body(offset + i - 1));
+		if (i == ret)
+			value = b;
+	}
+
+	if (v2Body(offset) == 0xAC && v2Body(offset + 1) == 0x80)
+		setErased(true);
+
+	return gangCheck(value);
+}
+
+void v2SpiMulti(uint8_t cmd)
+{
+	uint8_t tx = _v2_head[1];
+	uint8_t rx = _v2_head[2];
+	uint8_t start = _v2_head[3];
+
+	v2Begin(rx + 3, cmd, STATUS_CMD_OK);
+
+	while (_spi.busy)
+		;
+	for (uint16_t i = 0; i < tx || i < start + rx; i++)
+	{
+		uint8_t b = ispByte(i < tx ? v2Body(4 + i) : 0x00);
+		if (i >= start && i < start + rx)
+			v2Byte(gangCheck(b));
+	}
+
+	if (tx >= 2 && v2Body(4) == 0xAC && v2Body(5) == 0x80)
+		setErased(true);
+
+	v2Byte(STATUS_CMD_OK);
+	v2End();
+}
+
+static const char _v2_signon[] = "AVRISP_2";
+
+// The v2 SCK duration is on a scale of its own: 0 to 3 are 1.8MHz, 460kHz,
+// 115kHz and 57.6kHz, past that the clock is STK500_XTAL / (24 * d + 20),
+// as avrdude counts it.
+uint32_t v2SckFrequency(uint8_t duration)
+{
+	static const uint32_t fixed[] =
+	{ 1843200, 460800, 115200, 57600 };
+	return duration < 4 ?
+			fixed[duration] : STK500_XTAL / (24UL * duration + 20);
+}
+
+uint32_t sckFrequency(uint8_t index)
+{
+	return F_CPU / (2UL << index);
+}
+
+// the fastest step no faster than the host asks for
+void setV2SckDuration(uint8_t duration)
+{
+	uint32_t frequency = v2SckFrequency(duration);
+	_sck_first = 0;
+	while (_sck_first < SCK_STEPS - 1 && sckFrequency(_sck_first) > frequency)
+		_sck_first++;
+}
+
+// the duration of the clock step in use, rounded to the slower side
+uint8_t v2SckDuration()
+{
+	uint32_t frequency = sckFrequency(_sck_index);
+	uint8_t duration = 0;
+	while (duration < 0xFF && v2SckFrequency(duration) > frequency)
+		duration++;
+	return duration;
+}
+
+void avrispV2()
+{
+	uint8_t sum = MESSAGE_START;
+	uint8_t header[4];
+
+	for (uint8_t i = 0; i < 4; i++)
+		sum ^= header[i] = getch();
+
+	_v2_seq = header[0];
+	uint16_t size = makeWord(header[1], header[2]);
+
+	// out of step, wait for the next MESSAGE_START
+	if (header[3] != TOKEN)
+	{
+		fault(FAULT_SYNC);
+		return;
+	}
+
+	for (uint16_t i = 0; i < size; i++)
+	{
+		uint8_t b = getch();
+		sum ^= b;
+		if (i < V2_HEAD)
+			_v2_head[i] = b;
+		else if (i < V2_BODY)
+			_buff[i - V2_HEAD] = b;
+	}
+
+	if (getch() != sum)
+	{
+		fault(FAULT_SYNC);
+		STAT_COUNT(nosync);
+		v2Answer(ANSWER_CKSUM_ERROR, STATUS_CKSUM_ERROR);
+		return;
+	}
+
+	uint8_t cmd = _v2_head[0];
+	if (size > V2_BODY)
+	{
+		_error = true;
+		v2Answer(cmd, STATUS_CMD_FAILED);
+		return;
+	}
+
+	// the previous page has been loading during this message, if it failed
+	// that is the answer to this one. Leaving programming mode still leaves.
+	bool flushed = cmd == CMD_PROGRAM_FLASH_ISP || flushPage();
+	if (!flushed && cmd != CMD_LEAVE_PROGMODE_ISP)
+	{
+		v2Answer(cmd, STATUS_CMD_FAILED);
+		return;
+	}
+
+	uint8_t value;
+	switch (cmd)
+	{
+	case CMD_SIGN_ON:
+		clearError();
+		v2Begin(3 + sizeof(_v2_signon) - 1, cmd, STATUS_CMD_OK);
+		v2Byte(sizeof(_v2_signon) - 1);
+		for (const char *p = _v2_signon; *p; p++)
+			v2Byte(*p);
+		v2End();
+		break;
+	case CMD_SET_PARAMETER:
+		if (_v2_head[1] == PARAM_SCK_DURATION)
+		{
+			setV2SckDuration(_v2_head[2]);
+			v2Answer(cmd, STATUS_CMD_OK);
+		}
+		else if (setVendorParameter(_v2_head[1], _v2_head[2]))
+		{
+			v2Answer(cmd, STATUS_CMD_OK);
+			if (_v2_head[1] == PARM_BAUD)
+				setBaud(_v2_head[2]);
+		}
+		else
+			v2Answer(cmd, STATUS_CMD_FAILED);
+		break;
+	case CMD_GET_PARAMETER:
+		switch (_v2_head[1])
+		{
+		case PARAM_BUILD_NUMBER_LOW:
+		case PARAM_BUILD_NUMBER_HIGH:
+			value = 0;
+			break;
+		case PARAM_HW_VER:
+			value = HARDWARE_VERSION;
+			break;
+		case PARAM_SW_MAJOR:
+			value = FIRMWARE_MAJOR_VERSION;
+			break;
+		case PARAM_SW_MINOR:
+			value = FIRMWARE_MINOR_VERSION;
+			break;
+		case PARAM_VTARGET:
+			value = 50; // not measured, report 5.0V
+			break;
+		case PARAM_SCK_DURATION:
+			value = v2SckDuration();
+			break;
+		case PARAM_TOPCARD_DETECT:
+			value = 0xFF; // no top card
+			break;
+		default:
+			if (!getVendorParameter(_v2_head[1], value))
+			{
+				v2Answer(cmd, STATUS_CMD_FAILED);
+				return;
+			}
+			break;
+		}
+		v2Begin(3, cmd, STATUS_CMD_OK);
+		v2Byte(value);
+		v2End();
+		break;
+	case CMD_LOAD_ADDRESS:
+		// bit 31 asks for the extended address, which is tracked anyway
+		_v2_address = (uint32_t) _v2_head[2] << 16
+				| makeWord(_v2_head[3], _v2_head[4]);
+		v2Answer(cmd, STATUS_CMD_OK);
+		break;
+	case CMD_ENTER_PROGMODE_ISP:
+		// the clock negotiation replaces the host's synch loops
+		v2Answer(cmd,
+				_programming || beginProgramming() ?
+						STATUS_CMD_OK : STATUS_CMD_FAILED);
+		break;
+	case CMD_LEAVE_PROGMODE_ISP:
+		clearError();
+		endProgramming();
+		v2Answer(cmd, flushed ? STATUS_CMD_OK : STATUS_CMD_FAILED);
+		break;
+	case CMD_CHIP_ERASE_ISP:
+		v2Instruction(3, 4);
+		if (_v2_head[2])
+		{
+			_param.polling = true;
+			value = setErased(eraseWait());
+		}
+		else
+		{
+			delay(_v2_head[1]);
+			value = true;
+		}
+		v2Answer(cmd, value ? STATUS_CMD_OK : STATUS_RDY_BSY_TOUT);
+		break;
+	case CMD_PROGRAM_FLASH_ISP:
+	case CMD_PROGRAM_EEPROM_ISP:
+		v2Answer(cmd, v2Program(cmd == CMD_PROGRAM_FLASH_ISP, size));
+		break;
+	case CMD_READ_FLASH_ISP:
+	case CMD_READ_EEPROM_ISP:
+		v2Read(cmd, cmd == CMD_READ_FLASH_ISP);
+		break;
+	case CMD_PROGRAM_FUSE_ISP:
+	case CMD_PROGRAM_LOCK_ISP:
+		v2Instruction(1, 4);
+		value = waitReady(0x00, 0, 0xFF, 0xFF, 0xFF) ?
+				STATUS_CMD_OK : STATUS_RDY_BSY_TOUT;
+		// a target lost to the retune is no timeout
+		if (value == STATUS_CMD_OK && cmd == CMD_PROGRAM_FUSE_ISP && !retune())
+			value = STATUS_CMD_FAILED;
+		v2Begin(3, cmd, STATUS_CMD_OK);
+		v2Byte(value);
+		v2End();
+		break;
+	case CMD_READ_FUSE_ISP:
+	case CMD_READ_LOCK_ISP:
+	case CMD_READ_SIGNATURE_ISP:
+	case CMD_READ_OSCCAL_ISP:
+		v2AnswerByte(cmd, v2Instruction(2, _v2_head[1]));
+		break;
+	case CMD_SPI_MULTI:
+		v2SpiMulti(cmd);
+		break;
+	default:
+		_error = true;
+		v2Answer(cmd, STATUS_CMD_UNKNOWN);
+		break;
+	}
+}
+#endif
+
+#if STANDALONE
+// Image store layout (offsets in the SPI flash, multi-byte values big endian)
+// 0x00000 "AISP"
+// 0x00004 device parameters as sent with 'B', 20 bytes
+// 0x00018 flash image length, 4 bytes
+// 0x0001C EEPROM image length, 2 bytes
+// 0x0001E number of fuse and lock instructions
+// 0x0001F fuse and lock ISP instructions, 4 bytes each, run after the
+//         memories have been written
+// 0x01000 flash image
+// 0x41000 EEPROM image
+#define IMAGE_PARAMETERS	0x00004
+#define IMAGE_LENGTHS		0x00018
+#define IMAGE_FUSES			0x0001F
+#define IMAGE_MAX_FUSES		8
+#define IMAGE_FLASH			0x01000
+#define IMAGE_EEPROM		0x41000
+#define IMAGE_FLASH_SIZE	(IMAGE_EEPROM - IMAGE_FLASH)
+
+#define STORE_PAGE			256
+#define STORE_TIMEOUT		60000UL // ms, chip erase of the larger parts
+
+static pin _store_cs, _store_sck, _store_mosi, _store_miso;
+
+void storeBegin()
+{
+	_store_cs = pinOut(STORE_CS);
+	pinSet(_store_cs, HIGH);
+	_store_sck = pinOut(STORE_SCK);
+	_store_mosi = pinOut(STORE_MOSI);
+	_store_miso = pinIn(STORE_MISO);
+
+	pinMode(BUTTON, INPUT_PULLUP);
+}
+
+// mode 0 bit-banged through the port registers
+uint8_t storeByte(uint8_t b)
+{
+	for (uint8_t i = 8; i--;)
+	{
+		pinSet(_store_mosi, b & 0x80);
+		b <<= 1;
+		pinSet(_store_sck, HIGH);
+		if (*_store_miso.reg & _store_miso.mask)
+			b |= 0x01;
+		pinSet(_store_sck, LOW);
+	}
+	return b;
+}
+
+void storeCommand(uint8_t cmd, uint32_t offset)
+{
+	pinSet(_store_cs, LOW);
+	storeByte(cmd);
+	storeByte(offset >> 16);
+	storeByte(offset >> 8);
+	storeByte(offset);
+}
+
+void storeEnd()
+{
+	pinSet(_store_cs, HIGH);
+}
+
+bool storeWait(uint32_t timeout)
+{
+	uint32_t start = millis();
+	bool busy;
+
+	do
+	{
+		pinSet(_store_cs, LOW);
+		storeByte(0x05); // read status register, bit 0 is WIP
+		busy = storeByte(0x00) & 0x01;
+		storeEnd();
+	} while (busy && millis() - start < timeout);
+
+	return !busy;
+}
+
+void storeWriteEnable()
+{
+	pinSet(_store_cs, LOW);
+	storeByte(0x06);
+	storeEnd();
+}
+
+void storeRead(uint32_t offset, uint8_t *p, uint16_t length)
+{
+	storeCommand(0x03, offset);
+	while (length--)
+		*p++ = storeByte(0x00);
+	storeEnd();
+}
+
+bool storeWrite(uint32_t offset, const uint8_t *p, uint16_t length)
+{
+	while (length)
+	{
+		// page program wraps at the store page, split there
+		uint16_t chunk = STORE_PAGE - (offset & (STORE_PAGE - 1));
+		if (chunk > length)
+			chunk = length;
+
+		storeWriteEnable();
+		storeCommand(0x02, offset);
+		for (uint16_t i = 0; i < chunk; i++)
+			storeByte(*p++);
+		storeEnd();
+
+		if (!storeWait(POLL_TIMEOUT))
+			return false;
+
+		offset += chunk;
+		length -= chunk;
+	}
+	return true;
+}
+
+bool storeErase()
+{
+	storeWriteEnable();
+	pinSet(_store_cs, LOW);
+	storeByte(0xC7);
+	storeEnd();
+	return storeWait(STORE_TIMEOUT);
+}
+
+// Burn the stored image, returns STK_OK, STK_FAILED or STK_NODEVICE
+uint8_t burnImage()
+{
+#if READ_CACHE
+	cacheDrop();
+#endif
+	storeRead(0, _buff, 4);
+	if (memcmp(_buff, "AISP", 4))
+		return STK_FAILED;
+
+	storeRead(IMAGE_PARAMETERS, _buff, 20);
+	setParameters();
+
+	uint8_t lengths[7];
+	storeRead(IMAGE_LENGTHS, lengths, sizeof(lengths));
+	uint32_t flash_length = (uint32_t) lengths[0] << 24
+			| (uint32_t) lengths[1] << 16 | (uint16_t) lengths[2] << 8
+			| lengths[3];
+	uint16_t eeprom_length = lengths[4] << 8 | lengths[5];
+	uint8_t fuses = lengths[6];
+	uint16_t pagesize = FLASH_PAGESIZE;
+
+	if (!pagesize || pagesize > BUFF_LENGTH || flash_length > IMAGE_FLASH_SIZE
+			|| eeprom_length > EEPROM_SIZE || fuses > IMAGE_MAX_FUSES)
+		return STK_FAILED;
+
+	if (!beginProgramming())
+		return STK_NODEVICE;
+
+	// the CRC of what went out is checked against the target at the end
+	uint16_t crc = 0xFFFF;
+	bool ok = chipErase();
+	for (uint32_t offset = 0; ok && offset < flash_length; offset += pagesize)
+	{
+		uint16_t length =
+				flash_length - offset < pagesize ? flash_length - offset : pagesize;
+
+		storeRead(IMAGE_FLASH + offset, _buff, length);
+		for (uint16_t i = 0; i < length; i++)
+			crc = crc16Update(crc, _buff[i]);
+
+		if (skipPage(_buff, length))
+			continue;
+
+		if (!(ok = flushPage()))
+			break;
+		queuePage(getPage(offset >> 1), length);
+	}
+	ok = flushPage() && ok;
+
+	uint16_t check = 0xFFFF;
+	for (uint32_t offset = 0; ok && offset < flash_length; offset += 0x8000)
+	{
+		uint32_t length = flash_length - offset;
+		check = spiChecksum(0x20, 0x08, offset >> 1,
+				length < 0x8000 ? length : 0x8000, check);
+	}
+	ok = ok && check == crc;
+
+	for (uint16_t offset = 0; ok && offset < eeprom_length;
+			offset += BUFF_LENGTH)
+	{
+		uint16_t length =
+				eeprom_length - offset < BUFF_LENGTH ?
+						eeprom_length - offset : BUFF_LENGTH;
+
+		storeRead(IMAGE_EEPROM + offset, _buff, length);
+		ok = programEeprom(offset, length);
+	}
+
+	// before the fuses, the lock bits may be among them
+	if (ok && serialNumberOn())
+		ok = serialNumberWrite();
+
+	for (uint8_t i = 0; ok && i < fuses; i++)
+	{
+		storeRead(IMAGE_FUSES + i * 4, _buff, 4);
+		spiTransfer(_buff[0], _buff[1], _buff[2], _buff[3]);
+		ok = waitReady(0x00, 0, 0xFF, 0xFF, 0xFF);
+	}
+
+	endProgramming();
+
+	if (!ok)
+		_error = true;
+	return ok ? STK_OK : STK_FAILED;
+}
+
+void store(uint8_t ch)
+{
+	uint32_t offset = 0;
+	uint16_t length = 0;
+
+	if (ch != VND_STORE_ERASE && ch != VND_BURN)
+	{
+		for (uint8_t i = 0; i < 4; i++)
+			offset = offset << 8 | getch();
+		length = getch() << 8;
+		length |= getch();
+
+		if (length > BUFF_LENGTH)
+		{
+			_error = true;
+			Serial.write(STK_FAILED);
+			return;
+		}
+	}
+
+	if (ch == VND_STORE_WRITE)
+		fill(length);
+
+	if (!receiveEop())
+		return;
+
+	switch (ch)
+	{
+	case VND_STORE_ERASE:
+		Serial.write(storeErase() ? STK_OK : STK_FAILED);
+		break;
+	case VND_STORE_WRITE:
+		Serial.write(storeWrite(offset, _buff, length) ? STK_OK : STK_FAILED);
+		break;
+	case VND_STORE_READ:
+		storeRead(offset, _buff, length);
+		for (uint16_t i = 0; i < length; i++)
+			Serial.write(_buff[i]);
+		Serial.write(STK_OK);
+		break;
+	case VND_BURN:
+		Serial.write(_programming ? STK_FAILED : burnImage());
+		break;
+	}
+}
+
+void button()
+{
+	static bool down;
+	static uint32_t since; // last time the pin read as down says
+
+	// a press burns once, the next one needs a release in between, bounce on
+	// either edge is shorter than BUTTON_DEBOUNCE
+	bool low = digitalRead(BUTTON) == LOW;
+	if (low == down)
+	{
+		since = millis();
+		return;
+	}
+	if (millis() - since < BUTTON_DEBOUNCE)
+		return;
+
+	down = low;
+	if (down && !_programming)
+	{
+		clearError();
+		if (burnImage() == STK_OK)
+#if LED_TIMER
+			ledFlash(_led_programming, 3);
+#else
+			pulse(LED_PROGRAMMING, 3);
+#endif
+	}
+	// the release is timed from the end of the burn
+	since = millis();
+}
+#endif
+
+void avrisp()
+{
+	static uint32_t address = 0; // word address, bits 16-23 from 0x4D
+	uint8_t ch = getch();
+#if READ_CACHE
+	if (ch != 0x74 && ch != 'U' && ch != 'V')
+		cacheDrop();
+#endif
+	switch (ch)
 	{
 	case '0': // signon
-		_error = 0;
+		clearError();
 		reply();
 		break;
 	case '1':
@@ -430,6 +3641,10 @@ void avrisp()
 			Serial.write(STK_OK);
 		}
 		break;
+	case '@': // set parameter
+		ch = getch();
+		setParameter(ch, getch());
+		break;
 	case 'A':
 		replyVersion(getch());
 		break;
@@ -438,18 +3653,35 @@ void avrisp()
 		setParameters();
 		reply();
 		break;
-	case 'E': // extended parameters - ignore for now
+	case 'E': // extended parameters
 		fill(5);
+		setExtParameters();
 		reply();
 		break;
 	case 'P':
-		_programming ? pulse(LED_ERROR, 3) : beginProgramming();
-		reply();
+		if (_programming)
+		{
+#if LED_TIMER
+			ledFlash(_led_error, 3);
+#else
+			pulse(LED_ERROR, 3);
+#endif
+			reply();
+		}
+		else if (beginProgramming())
+			reply();
+		else
+			reply(true, STK_NODEVICE, false);
 		break;
 	case 'U': // set address (word)
-		address = getch() | (getch() << 8);
+	{
+		// low byte first, an int shift of the high one would sign extend
+		uint8_t low = getch();
+		uint8_t high = getch();
+		address = (address & 0xFFFF0000) | makeWord(high, low);
 		reply();
 		break;
+	}
 	case 0x60: //STK_PROG_FLASH
 		getch();
 		getch();
@@ -465,21 +3697,78 @@ void avrisp()
 	case 0x74: //STK_READ_PAGE 't'
 		readPage(address);
 		break;
+	case 'R': //STK_CHIP_ERASE 0x52
+		erase();
+		break;
 	case 'V': //0x56
-		universal();
+		universal(address);
 		break;
 	case 'Q': //0x51
-		_error = 0;
+	{
+		// the last page may have failed after its STK_OK went out
+		bool ok = flushPage();
+		clearError();
 		endProgramming();
-		reply();
+		reply(false, 0x00, true, ok);
+		if (_baud)
+			setBaud(0);
 		break;
+	}
 	case 0x75: //STK_READ_SIGN 'u'
 		readSignature();
 		break;
+#if !LEAN
+	case VND_CHECKSUM:
+		checksum(address);
+		break;
+	case VND_STREAM_WRITE:
+		streamWrite(address);
+		break;
+	case VND_DUMP:
+		dump(address);
+		break;
+	case VND_BATCH:
+		batch();
+		break;
+	case VND_PACKED_WRITE:
+		packedWrite(address);
+		break;
+	case VND_RESUME:
+		resume();
+		break;
+	case VND_JOB:
+		job();
+		break;
+	case VND_SERIAL_NUMBER:
+		setSerialNumber();
+		break;
+	case VND_INJECT:
+		inject();
+		break;
+#endif
+#if STATS
+	case VND_STATS:
+		stats();
+		break;
+#endif
+#if STK500V2
+	case MESSAGE_START:
+		avrispV2();
+		break;
+#endif
+#if STANDALONE
+	case VND_STORE_ERASE:
+	case VND_STORE_WRITE:
+	case VND_STORE_READ:
+	case VND_BURN:
+		store(ch);
+		break;
+#endif
 		// expecting a command, not CRC_EOP
 		// this is how we can get back in sync
 	case CRC_EOP:
-		_error = true;
+		fault(FAULT_SYNC);
+		STAT_COUNT(nosync);
 		Serial.write(STK_NOSYNC);
 		break;
 	default: // anything else we will return STK_UNKNOWN
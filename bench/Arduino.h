@@ -0,0 +1,117 @@
+// Host stand-in for the little of the Arduino core the sketch uses. Time is
+// virtual, see bench.cpp: the serial line, the SPI and the target take the
+// time they would on the board, waits in the sketch move the clock on.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint8_t byte;
+#define F_CPU 16000000UL
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define MSBFIRST 1
+#define _BV(b) (1 << (b))
+#define lowByte(w) ((uint8_t) ((w) & 0xFF))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+int digitalRead(uint8_t pin);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long millis();
+unsigned long micros();
+uint16_t makeWord(uint8_t h, uint8_t l);
+
+// Uno pins
+#define SS 10
+#define MOSI 11
+#define MISO 12
+#define SCK 13
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+// pinOut() and pinIn() only need registers to point at
+extern volatile uint8_t *port_to_output[];
+extern volatile uint8_t *port_to_input[];
+uint8_t digitalPinToPort(uint8_t pin);
+uint8_t digitalPinToBitMask(uint8_t pin);
+#define portOutputRegister(p) (port_to_output[p])
+#define portInputRegister(p) (port_to_input[p])
+
+// The interrupts are run by the bench when they would be taken: the SPI and
+// USART ones once SREG has the I bit set and no other one is running, the
+// timer one for the LEDs never. SREG is an object for that, a read costs the
+// time of the core's Serial.available() it stands in for.
+struct StatusRegister
+{
+	uint8_t value;
+	operator uint8_t();
+	StatusRegister &operator=(uint8_t v); // takes what became pending
+};
+extern StatusRegister SREG;
+extern volatile uint8_t SPCR, SPSR, OCR0A, TIMSK0;
+#define SREG_I 7
+static inline void cli() { SREG.value &= ~_BV(SREG_I); }
+#define ISR(v) extern "C" void v(); void v()
+#define SPE 6
+#define SPIE 7
+#define SPIF 7
+#define OCIE0A 1
+
+struct SpiData
+{
+	uint8_t in;
+	SpiData &operator=(uint8_t out); // a byte exchanged with the target
+	operator uint8_t();
+};
+extern SpiData SPDR;
+
+#ifndef BENCH_CORE_SERIAL
+// USART0 of the ATmega328P, the sketch drives it with its own ring. A read
+// of a control register costs CALL_US, the sketch spins on them.
+struct UartRegister
+{
+	uint8_t which;
+	operator uint16_t();
+	UartRegister &operator=(uint16_t v);
+	UartRegister &operator|=(uint8_t v) { return *this = *this | v; }
+	UartRegister &operator&=(uint8_t v) { return *this = *this & v; }
+};
+extern UartRegister UCSR0A, UCSR0B, UCSR0C, UBRR0, UDR0;
+#define UCSR0A UCSR0A
+#define USART_RX_vect USART_RX_vect
+#define USART_UDRE_vect USART_UDRE_vect
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define DOR0 3
+#define U2X0 1
+#define RXCIE0 7
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ01 2
+#define UCSZ00 1
+#else
+// UCSR0A left undefined, the sketch uses Serial as on a 32U4
+struct HardwareSerial
+{
+	void begin(unsigned long baud);
+	int available();
+	int read();
+	size_t write(uint8_t b);
+	size_t print(const char *s);
+	void flush();
+};
+extern HardwareSerial Serial;
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+#include "Arduino.h"
+
+// the codes are the divider, SPI.setClockDivider() takes them as they are
+#define SPI_CLOCK_DIV2 2
+#define SPI_CLOCK_DIV4 4
+#define SPI_CLOCK_DIV8 8
+#define SPI_CLOCK_DIV16 16
+#define SPI_CLOCK_DIV32 32
+#define SPI_CLOCK_DIV64 64
+#define SPI_CLOCK_DIV128 128
+
+struct SPIClass
+{
+	void begin();
+	void end();
+	void setDataMode(uint8_t mode);
+	void setBitOrder(uint8_t order);
+	void setClockDivider(uint8_t divider);
+};
+extern SPIClass SPI;
@@ -0,0 +1,6 @@
+#pragma once
+#include <stddef.h>
+
+// the programmer's own EEPROM
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_update_block(const void *src, void *dst, size_t n);
@@ -0,0 +1,1028 @@
+// Host benchmark and replay harness for the sketch. avrisp() and the page
+// routines run as they are, against a mock serial line and SPI bus with an
+// ATmega328P behind it, all on a virtual clock:
+// - a byte on the line takes 10 bit times. By default the sketch drives a
+//   mock USART0 with its own ring, at the rate UBRR0 gives, and the
+//   USART's receive FIFO of 3 bytes overruns if the interrupt falls behind.
+//   Built with BENCH_CORE_SERIAL it uses a mock Serial instead, at the rate
+//   of the last Serial.begin(), with the core's 63 byte receive buffer.
+// - an SPI byte takes 8 clocks of the divider in use
+// - the SPI and USART interrupts are taken when they come due, as long as
+//   SREG allows and no other one is running
+// - the target is busy for its datasheet write times, an instruction other
+//   than a poll or a read while it is busy is counted as a violation
+// - every call into the core costs CALL_US, waits in the sketch move the
+//   clock on through them
+// The host sends a command once the answer to the last one is in, plus the
+// turnaround latency of its USB serial bridge.
+//
+// bench [-n bytes] [-s baud index] [-l latency us] [-w file] [-r file] [-q]
+//   -n  size of the generated flash image, a multiple of 128 (default 32K)
+//   -s  switch to _bauds[index] with '@' PARM_BAUD after sign-on
+//   -l  host turnaround per command in us (default 1000)
+//   -w  write the generated session with the answers to file
+//   -r  replay a session file instead, answers in it are checked
+//   -q  no table of command latencies
+// A session file has a command per line, "> 30 20", optionally followed by
+// the answer expected, "< 14 10", or "< *" for one that is recorded as not
+// checked. ">2 01" and "<2 01 00 08 ..." are the bodies of STK500v2
+// messages, framed with the sequence number and checksum by the bench.
+// Lines starting with # are comments.
+// The exit status is 1 if an answer differs, the target saw a violation,
+// the receive buffer overran or the image did not make it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../ArduinoISP/ArduinoISP.cpp"
+
+#ifndef CALL_US
+#define CALL_US 0.25
+#endif
+
+static double _now; // us
+
+StatusRegister SREG;
+volatile uint8_t SPCR, SPSR, OCR0A, TIMSK0;
+SpiData SPDR;
+SPIClass SPI;
+
+static void advance(double to);
+
+static volatile uint8_t _ports[4];
+volatile uint8_t *port_to_output[] =
+{ _ports, _ports + 1, _ports + 2, _ports + 3 };
+volatile uint8_t *port_to_input[] =
+{ _ports, _ports + 1, _ports + 2, _ports + 3 };
+
+uint8_t digitalPinToPort(uint8_t pin)
+{
+	return pin / 8;
+}
+
+uint8_t digitalPinToBitMask(uint8_t pin)
+{
+	return 1 << (pin % 8);
+}
+
+uint16_t makeWord(uint8_t h, uint8_t l)
+{
+	return h << 8 | l;
+}
+
+unsigned long millis()
+{
+	advance(_now + CALL_US);
+	return (unsigned long) (_now / 1000);
+}
+
+unsigned long micros()
+{
+	advance(_now + CALL_US);
+	return (unsigned long) _now;
+}
+
+void delay(unsigned long ms)
+{
+	advance(_now + ms * 1000.0);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	advance(_now + us);
+}
+
+static uint8_t _host_eeprom[1024];
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+	memcpy(dst, _host_eeprom + (size_t) src, n);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+	memcpy(_host_eeprom + (size_t) dst, src, n);
+}
+
+// ATmega328P on the ISP lines
+#define T_FLASH		32768
+#define T_PAGE		128
+#define T_EEPROM	1024
+#define T_EEPAGE	4
+#define T_WD_FLASH	4500.0 // us
+#define T_WD_EEPROM	3600.0
+#define T_WD_ERASE	9000.0
+#define T_WD_FUSE	4500.0
+
+struct BenchTarget
+{
+	uint8_t flash[T_FLASH];
+	uint8_t eeprom[T_EEPROM];
+	uint8_t page[T_PAGE];
+	uint8_t eepage[T_EEPAGE];
+	uint8_t eeloaded;
+	uint8_t fuses[4]; // low, high, extended, lock
+	bool reset;
+	bool programming;
+	uint8_t pos;
+	uint8_t in[4];
+	double busy_until;
+	unsigned pages;
+	unsigned violations;
+
+	void begin()
+	{
+		memset(flash, 0xFF, sizeof(flash));
+		memset(eeprom, 0xFF, sizeof(eeprom));
+		memset(page, 0xFF, sizeof(page));
+		eeloaded = 0;
+		fuses[0] = 0xFF;
+		fuses[1] = 0xDA;
+		fuses[2] = 0xFD;
+		fuses[3] = 0xFF;
+		reset = false;
+		programming = false;
+		pos = 0;
+		busy_until = 0;
+		pages = violations = 0;
+	}
+
+	void setReset(bool low)
+	{
+		if (low != reset)
+		{
+			reset = low;
+			programming = false;
+			pos = 0;
+		}
+	}
+
+	bool busy()
+	{
+		return _now < busy_until;
+	}
+
+	uint32_t word()
+	{
+		return (in[1] << 8 | in[2]) % (T_FLASH / 2);
+	}
+
+	uint8_t answer()
+	{
+		switch (in[0])
+		{
+		case 0x30:
+			return (const uint8_t[]) { 0x1E, 0x95, 0x0F }[in[2] % 3];
+		case 0x20:
+		case 0x28:
+			return busy() ? 0xFF : flash[word() * 2 + (in[0] >> 3 & 1)];
+		case 0xA0:
+			return busy() ? 0xFF : eeprom[(in[1] << 8 | in[2]) % T_EEPROM];
+		case 0xF0:
+			return busy();
+		case 0x50:
+			return fuses[in[1] == 0x08 ? 2 : 0];
+		case 0x58:
+			return fuses[in[1] == 0x08 ? 1 : 3];
+		case 0x38:
+			return 0x9A;
+		}
+		return 0x00;
+	}
+
+	void execute()
+	{
+		if (!programming)
+		{
+			programming = in[0] == 0xAC && in[1] == 0x53;
+			return;
+		}
+
+		bool read = in[0] == 0xF0 || in[0] == 0x30 || in[0] == 0x20
+				|| in[0] == 0x28 || in[0] == 0xA0 || in[0] == 0x50
+				|| in[0] == 0x58 || in[0] == 0x38;
+		if (read)
+			return;
+		if (busy())
+		{
+			violations++;
+			return;
+		}
+
+		uint32_t base;
+		switch (in[0])
+		{
+		case 0x40:
+		case 0x48:
+			page[(in[2] % (T_PAGE / 2)) * 2 + (in[0] >> 3 & 1)] = in[3];
+			break;
+		case 0x4C:
+			// a page write only clears bits
+			base = (word() & ~(uint32_t) (T_PAGE / 2 - 1)) * 2;
+			for (uint16_t i = 0; i < T_PAGE; i++)
+				flash[base + i] &= page[i];
+			memset(page, 0xFF, sizeof(page));
+			busy_until = _now + T_WD_FLASH;
+			pages++;
+			break;
+		case 0xC0:
+			eeprom[(in[1] << 8 | in[2]) % T_EEPROM] = in[3];
+			busy_until = _now + T_WD_EEPROM;
+			break;
+		case 0xC1:
+			eepage[in[2] % T_EEPAGE] = in[3];
+			eeloaded |= 1 << (in[2] % T_EEPAGE);
+			break;
+		case 0xC2:
+			base = (in[1] << 8 | in[2]) % T_EEPROM & ~(T_EEPAGE - 1);
+			for (uint8_t i = 0; i < T_EEPAGE; i++)
+				if (eeloaded & 1 << i)
+					eeprom[base + i] = eepage[i];
+			eeloaded = 0;
+			busy_until = _now + T_WD_EEPROM;
+			break;
+		case 0xAC:
+			if (in[1] == 0x80)
+			{
+				memset(flash, 0xFF, sizeof(flash));
+				memset(eeprom, 0xFF, sizeof(eeprom));
+				busy_until = _now + T_WD_ERASE;
+			}
+			else
+			{
+				uint8_t f = in[1] == 0xA0 ? 0 : in[1] == 0xA8 ? 1
+						: in[1] == 0xA4 ? 2 : 3;
+				fuses[f] = in[3];
+				busy_until = _now + T_WD_FUSE;
+			}
+			break;
+		}
+	}
+
+	// a byte each way, the target echoes the bytes before the data one
+	uint8_t exchange(uint8_t b)
+	{
+		if (!reset)
+			return 0xFF;
+
+		uint8_t out = 0x00;
+		if (!programming)
+			out = pos == 2 && in[0] == 0xAC && in[1] == 0x53 ? 0x53 : 0x00;
+		else if (pos == 1 || pos == 2)
+			out = in[pos - 1];
+		else if (pos == 3)
+			out = answer();
+
+		in[pos++] = b;
+		if (pos == 4)
+		{
+			execute();
+			pos = 0;
+		}
+		return out;
+	}
+};
+
+static BenchTarget _target;
+static uint8_t _spi_divider = 4;
+static bool _in_isr;
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	// a released RESET is pulled up
+	if (pin == RESET && mode == INPUT)
+		_target.setReset(false);
+}
+
+void digitalWrite(uint8_t pin, uint8_t level)
+{
+	if (pin == RESET)
+		_target.setReset(level == LOW);
+}
+
+int digitalRead(uint8_t)
+{
+	return HIGH;
+}
+
+void SPIClass::begin()
+{
+}
+
+void SPIClass::end()
+{
+}
+
+void SPIClass::setDataMode(uint8_t)
+{
+}
+
+void SPIClass::setBitOrder(uint8_t)
+{
+}
+
+void SPIClass::setClockDivider(uint8_t divider)
+{
+	_spi_divider = divider;
+}
+
+// A byte is exchanged with the target as it is written, the transfer
+// complete interrupt is taken once SREG allows. The engine writes the next
+// byte from it, so a block started by spiStart() is done before the sketch
+// gets to wait for it. The bit banged clocks don't reach the target, the
+// bench runs the hardware ones.
+SpiData &SpiData::operator=(uint8_t out)
+{
+	advance(_now + 8.0 * _spi_divider / (F_CPU / 1000000));
+	in = _target.exchange(out);
+	SPSR |= _BV(SPIF);
+	advance(_now);
+	return *this;
+}
+
+SpiData::operator uint8_t()
+{
+	SPSR &= ~_BV(SPIF);
+	return in;
+}
+
+#if UART_RING
+#define LINE_RX_DEPTH 3 // the USART's two byte FIFO and its shift register
+#else
+#define LINE_RX_DEPTH 63 // the core's receive buffer
+#endif
+
+// the host's end of the line
+struct BenchLine
+{
+	double byte_us;
+	std::vector<std::pair<double, uint8_t> > pending; // arrival, byte
+	size_t next;
+	std::vector<uint8_t> rx;
+	double tx_done;
+	std::vector<uint8_t> out;
+	unsigned overruns;
+#if UART_RING
+	uint8_t ucsr0b, ucsr0c;
+	uint16_t ubrr0;
+	bool u2x;
+	bool txc;
+	bool sent; // since TXC0 was cleared
+#endif
+
+	void pump()
+	{
+		while (next < pending.size() && pending[next].first <= _now)
+		{
+#if UART_RING
+			// a byte is lost on a receiver that is off as on a full FIFO
+			if (!(ucsr0b & _BV(RXEN0)))
+				overruns++;
+			else
+#endif
+			if (rx.size() < LINE_RX_DEPTH)
+				rx.push_back(pending[next].second);
+			else
+				overruns++;
+			next++;
+		}
+	}
+
+#if UART_RING
+	void rate()
+	{
+		byte_us = 10.0 * (u2x ? 8 : 16) * (ubrr0 + 1) / (F_CPU / 1000000);
+	}
+
+	// UDR0 takes a byte when at most the one in the shift register is left
+	bool txFree()
+	{
+		return tx_done - byte_us <= _now + 1e-6;
+	}
+
+	// the sketch's write() spins on this until UDRE frees a slot
+	bool txRingFull()
+	{
+		return (_uart.tx_head + 1) % UART_TX_LENGTH == _uart.tx_tail;
+	}
+#endif
+
+	// the next time the line has something for the sketch, after now
+	double nextEvent(double to)
+	{
+		if (next < pending.size() && pending[next].first < to)
+			to = pending[next].first;
+#if UART_RING
+		if (ucsr0b & _BV(UDRIE0) && !txFree() && tx_done - byte_us < to)
+			to = tx_done - byte_us;
+#endif
+		return to;
+	}
+
+	bool drained()
+	{
+#if UART_RING
+		return next == pending.size() && rx.empty() && !_uart.used()
+				&& _uart.tx_head == _uart.tx_tail;
+#else
+		return next == pending.size() && rx.empty();
+#endif
+	}
+};
+
+static BenchLine _line;
+
+// Take the interrupts which are pending, in the order of their vectors, one
+// at a time. A full transmit ring has the clock move on to the next UDRE as
+// the spin in Uart::write() would, only a little earlier.
+static void serve()
+{
+	if (_in_isr || !(SREG.value & _BV(SREG_I)))
+		return;
+
+	_in_isr = true;
+	for (;;)
+	{
+		_line.pump();
+		// taking the vector clears SPIF
+		if (SPSR & _BV(SPIF) && SPCR & _BV(SPIE))
+		{
+			SPSR &= ~_BV(SPIF);
+			SPI_STC_vect();
+		}
+#if UART_RING
+		else if (_line.ucsr0b & _BV(RXCIE0) && !_line.rx.empty())
+			USART_RX_vect();
+		else if (_line.ucsr0b & _BV(UDRIE0) && _line.txFree())
+			USART_UDRE_vect();
+		else if (_line.ucsr0b & _BV(UDRIE0) && _line.txRingFull())
+			_now = std::max(_now, _line.nextEvent(_line.tx_done));
+#endif
+		else
+			break;
+	}
+	_in_isr = false;
+}
+
+// move the clock on to 'to', taking the interrupts as they come due
+static void advance(double to)
+{
+	serve();
+	while (_now < to)
+	{
+		_line.pump();
+		_now = _line.nextEvent(to);
+		serve();
+	}
+}
+
+StatusRegister::operator uint8_t()
+{
+	advance(_now + CALL_US);
+	return value;
+}
+
+StatusRegister &StatusRegister::operator=(uint8_t v)
+{
+	value = v;
+	advance(_now);
+	return *this;
+}
+
+#if UART_RING
+UartRegister UCSR0A = { 'A' }, UCSR0B = { 'B' }, UCSR0C = { 'C' },
+		UBRR0 = { 'R' }, UDR0 = { 'D' };
+
+UartRegister::operator uint16_t()
+{
+	uint8_t b;
+
+	switch (which)
+	{
+	case 'A':
+		advance(_now + CALL_US);
+		if (_line.sent && _now >= _line.tx_done)
+			_line.txc = true;
+		return (_line.rx.empty() ? 0 : _BV(RXC0))
+				| (_line.txc ? _BV(TXC0) : 0)
+				| (_line.txFree() ? _BV(UDRE0) : 0)
+				| (_line.u2x ? _BV(U2X0) : 0);
+	case 'B':
+		advance(_now + CALL_US);
+		return _line.ucsr0b;
+	case 'C':
+		return _line.ucsr0c;
+	case 'R':
+		return _line.ubrr0;
+	default:
+		if (_line.rx.empty())
+			return 0;
+		b = _line.rx.front();
+		_line.rx.erase(_line.rx.begin());
+		return b;
+	}
+}
+
+UartRegister &UartRegister::operator=(uint16_t v)
+{
+	switch (which)
+	{
+	case 'A':
+		_line.u2x = v & _BV(U2X0);
+		_line.rate();
+		// TXC0 is cleared by writing a one to it
+		if (v & _BV(TXC0))
+			_line.txc = _line.sent = false;
+		break;
+	case 'B':
+		_line.ucsr0b = v;
+		// turning the receiver off flushes the FIFO
+		if (!(v & _BV(RXEN0)))
+			_line.rx.clear();
+		advance(_now);
+		break;
+	case 'C':
+		_line.ucsr0c = v;
+		break;
+	case 'R':
+		_line.ubrr0 = v;
+		_line.rate();
+		break;
+	default:
+		_line.tx_done = std::max(_now, _line.tx_done) + _line.byte_us;
+		_line.out.push_back(v);
+		_line.sent = true;
+		break;
+	}
+	return *this;
+}
+#else
+HardwareSerial Serial;
+
+void HardwareSerial::begin(unsigned long baud)
+{
+	_line.byte_us = 10e6 / baud;
+}
+
+int HardwareSerial::available()
+{
+	advance(_now + CALL_US);
+	return _line.rx.size();
+}
+
+int HardwareSerial::read()
+{
+	advance(_now + CALL_US);
+	if (_line.rx.empty())
+		return -1;
+	uint8_t b = _line.rx.front();
+	_line.rx.erase(_line.rx.begin());
+	return b;
+}
+
+size_t HardwareSerial::write(uint8_t b)
+{
+	advance(_now + CALL_US);
+	// the core's transmit buffer holds 63 bytes, past that write() waits
+	advance(_line.tx_done - 63 * _line.byte_us);
+	_line.tx_done = std::max(_now, _line.tx_done) + _line.byte_us;
+	_line.out.push_back(b);
+	return 1;
+}
+
+size_t HardwareSerial::print(const char *s)
+{
+	size_t n = 0;
+	while (*s)
+		n += write(*s++);
+	return n;
+}
+
+void HardwareSerial::flush()
+{
+	advance(_line.tx_done);
+}
+#endif
+
+typedef std::vector<uint8_t> Bytes;
+
+struct BenchCommand
+{
+	Bytes send;
+	Bytes expect; // empty if not checked
+	bool unchecked; // "< *", kept as such when recorded
+	bool v2; // an STK500v2 message
+	std::string notes; // the comment lines before it
+};
+
+static const char _recorded[] =
+		"# recorded by bench, an ATmega328P behind the programmer\n";
+
+struct BenchStats
+{
+	unsigned count;
+	double total;
+	double max;
+};
+
+static double _latency = 1000; // us
+static double _host_ready;
+static std::map<uint16_t, BenchStats> _stats_by_cmd; // v2 ones from 0x100
+static unsigned _mismatches;
+
+// send a command once the host may, run the sketch until it is taken in and
+// answered, return the answer
+Bytes run(const BenchCommand &command)
+{
+	const Bytes &cmd = command.send;
+	while (_now < _host_ready)
+		loop();
+
+	double start = _now;
+	_line.pending.clear();
+	_line.next = 0;
+	for (size_t i = 0; i < cmd.size(); i++)
+		_line.pending.push_back(
+				std::make_pair(start + (i + 1) * _line.byte_us, cmd[i]));
+	_line.out.clear();
+
+	do
+	{
+		loop();
+		if (_now - start > 60e6)
+		{
+			fprintf(stderr, "stalled on command 0x%02X\n", cmd[0]);
+			exit(2);
+		}
+	} while (!_line.drained());
+
+	double done = std::max(_now, _line.tx_done);
+	BenchStats &s = _stats_by_cmd[command.v2 && cmd.size() > 5 ?
+			0x100 | cmd[5] : cmd[0]];
+	s.count++;
+	s.total += done - start;
+	s.max = std::max(s.max, done - start);
+	_host_ready = done + _latency;
+	return _line.out;
+}
+
+void put(Bytes &b, uint16_t w)
+{
+	b.push_back(w >> 8);
+	b.push_back(w & 0xFF);
+}
+
+// what avrdude sends to write and verify an image on an ATmega328P
+std::vector<BenchCommand> generate(const Bytes &image, int baud)
+{
+	std::vector<BenchCommand> session;
+	const uint8_t B[] =
+	{ 0x42, 0x86, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01, 0x03, 0xFF, 0xFF, 0xFF,
+			0xFF, 0x00, 0x80, 0x04, 0x00, 0x00, 0x00, 0x80, 0x00, 0x20 };
+	const uint8_t fixed[][8] =
+	{
+	{ 2, 0x30, 0x20 },
+	{ 2, 0x30, 0x20 },
+	{ 3, 0x41, 0x80, 0x20 },
+	{ 3, 0x41, 0x81, 0x20 },
+	{ 3, 0x41, 0x82, 0x20 },
+	{ 7, 0x45, 0x05, 0x04, 0xD7, 0xC2, 0x00, 0x20 } };
+
+	for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+	{
+		session.push_back(BenchCommand());
+		session.back().send.assign(fixed[i] + 1, fixed[i] + 1 + fixed[i][0]);
+		if (i == 4)
+		{
+			session.push_back(BenchCommand());
+			session.back().send.assign(B, B + sizeof(B));
+		}
+	}
+
+	const uint8_t after[][7] =
+	{
+	{ 2, 0x50, 0x20 },
+	{ 2, 0x75, 0x20 },
+	{ 6, 0x56, 0xAC, 0x80, 0x00, 0x00, 0x20 },
+	{ 2, 0x50, 0x20 } };
+	for (size_t i = 0; i < sizeof(after) / sizeof(after[0]); i++)
+	{
+		session.push_back(BenchCommand());
+		session.back().send.assign(after[i] + 1, after[i] + 1 + after[i][0]);
+	}
+
+	if (baud > 0)
+	{
+		session.push_back(BenchCommand());
+		const uint8_t at[] = { 0x40, PARM_BAUD, (uint8_t) baud, 0x20 };
+		session.back().send.assign(at, at + sizeof(at));
+	}
+
+	for (int verify = 0; verify < 2; verify++)
+		for (size_t a = 0; a < image.size(); a += T_PAGE)
+		{
+			BenchCommand u;
+			u.send.push_back(0x55);
+			u.send.push_back((a >> 1) & 0xFF);
+			u.send.push_back(a >> 9);
+			u.send.push_back(0x20);
+			session.push_back(u);
+
+			BenchCommand page;
+			page.send.push_back(verify ? 0x74 : 0x64);
+			put(page.send, T_PAGE);
+			page.send.push_back('F');
+			if (!verify)
+				page.send.insert(page.send.end(), image.begin() + a,
+						image.begin() + a + T_PAGE);
+			page.send.push_back(0x20);
+			if (verify)
+			{
+				page.expect.push_back(0x14);
+				page.expect.insert(page.expect.end(), image.begin() + a,
+						image.begin() + a + T_PAGE);
+				page.expect.push_back(0x10);
+			}
+			session.push_back(page);
+		}
+
+	session.push_back(BenchCommand());
+	session.back().send.push_back(0x51);
+	session.back().send.push_back(0x20);
+	return session;
+}
+
+Bytes hex(const char *s)
+{
+	Bytes b;
+	char *end;
+	for (;;)
+	{
+		unsigned long v = strtoul(s, &end, 16);
+		if (end == s)
+			return b;
+		b.push_back(v);
+		s = end;
+	}
+}
+
+// an STK500v2 message around body, or the body of one
+Bytes frame(uint8_t seq, const Bytes &body)
+{
+	Bytes b;
+	b.push_back(MESSAGE_START);
+	b.push_back(seq);
+	put(b, body.size());
+	b.push_back(TOKEN);
+	b.insert(b.end(), body.begin(), body.end());
+	uint8_t sum = 0;
+	for (size_t i = 0; i < b.size(); i++)
+		sum ^= b[i];
+	b.push_back(sum);
+	return b;
+}
+
+bool unframe(const Bytes &b, Bytes &body)
+{
+	if (b.size() < 6 || b[0] != MESSAGE_START || b[4] != TOKEN
+			|| b.size() != 6U + (b[2] << 8 | b[3]))
+		return false;
+	body.assign(b.begin() + 5, b.end() - 1);
+	return frame(b[1], body) == b;
+}
+
+std::vector<BenchCommand> load(const char *name)
+{
+	std::vector<BenchCommand> session;
+	FILE *f = fopen(name, "r");
+	if (!f)
+	{
+		perror(name);
+		exit(2);
+	}
+	char line[4096];
+	uint8_t seq = 0;
+	std::string notes;
+	while (fgets(line, sizeof(line), f))
+	{
+		bool v2 = line[1] == '2';
+		if (line[0] == '#' && strcmp(line, _recorded))
+			notes += line;
+		else if (line[0] == '>')
+		{
+			session.push_back(BenchCommand());
+			BenchCommand &c = session.back();
+			c.notes.swap(notes);
+			c.v2 = v2;
+			c.send = v2 ? frame(++seq, hex(line + 2)) : hex(line + 1);
+		}
+		else if (line[0] == '<' && !session.empty())
+		{
+			BenchCommand &c = session.back();
+			c.unchecked = line[1 + strspn(line + 1 + v2, " ") + v2] == '*';
+			if (!c.unchecked)
+				c.expect = v2 ? frame(seq, hex(line + 2)) : hex(line + 1);
+		}
+	}
+	fclose(f);
+	return session;
+}
+
+void print(FILE *f, const char *mark, const Bytes &b)
+{
+	fputs(mark, f);
+	for (size_t i = 0; i < b.size(); i++)
+		fprintf(f, " %02X", b[i]);
+	fputc('\n', f);
+}
+
+void save(const char *name, const std::vector<BenchCommand> &session,
+		const std::vector<Bytes> &answers)
+{
+	FILE *f = fopen(name, "w");
+	if (!f)
+	{
+		perror(name);
+		exit(2);
+	}
+	fputs(_recorded, f);
+	for (size_t i = 0; i < session.size(); i++)
+	{
+		fputs(session[i].notes.c_str(), f);
+		Bytes body;
+		if (session[i].v2 && unframe(session[i].send, body))
+			print(f, ">2", body);
+		else
+			print(f, ">", session[i].send);
+
+		if (session[i].unchecked)
+			fprintf(f, "< *\n");
+		else if (session[i].v2 && unframe(answers[i], body))
+			print(f, "<2", body);
+		else
+			print(f, "<", answers[i]);
+	}
+	fclose(f);
+}
+
+// the bytes a command writes to the target, or reads back from it
+size_t traffic(const BenchCommand &c, bool &read)
+{
+	Bytes b = c.send;
+	b.resize(std::max<size_t>(b.size(), 8));
+	uint8_t cmd = c.v2 ? b[5] : b[0];
+	read = false;
+
+	if (c.v2)
+	{
+		read = cmd == CMD_READ_FLASH_ISP || cmd == CMD_READ_EEPROM_ISP;
+		if (read || cmd == CMD_PROGRAM_FLASH_ISP
+				|| cmd == CMD_PROGRAM_EEPROM_ISP)
+			return b[6] << 8 | b[7];
+		return 0;
+	}
+
+	read = cmd == 0x74 || cmd == VND_DUMP;
+	switch (cmd)
+	{
+	case 0x64:
+	case 0x74:
+		return b[1] << 8 | b[2];
+	case VND_STREAM_WRITE:
+		return (b[2] << 8 | b[3]) * (b[4] << 8 | b[5]);
+	case VND_PACKED_WRITE:
+		return b[2] << 8 | b[3];
+	case VND_DUMP:
+		return (uint32_t) b[2] << 24 | (uint32_t) b[3] << 16 | b[4] << 8
+				| b[5];
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = T_FLASH;
+	int baud = 0;
+	const char *record = 0, *replay = 0;
+	bool quiet = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string a = argv[i];
+		const char *v = i + 1 < argc ? argv[i + 1] : "";
+		if (a == "-n")
+			size = strtoul(v, 0, 0), i++;
+		else if (a == "-s")
+			baud = atoi(v), i++;
+		else if (a == "-l")
+			_latency = atof(v), i++;
+		else if (a == "-w")
+			record = v, i++;
+		else if (a == "-r")
+			replay = v, i++;
+		else if (a == "-q")
+			quiet = true;
+		else
+		{
+			fprintf(stderr, "usage: %s [-n bytes] [-s baud index] "
+					"[-l latency us] [-w file] [-r file] [-q]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (size % T_PAGE || size > T_FLASH || baud < 0 || baud >= (int) BAUDS)
+	{
+		fprintf(stderr, "bad image size or baud index\n");
+		return 2;
+	}
+
+	memset(_host_eeprom, 0xFF, sizeof(_host_eeprom));
+	_target.begin();
+
+	// padding and a table next to random code, as a firmware image has
+	Bytes image(size);
+	srand(1);
+	for (size_t i = 0; i < size; i++)
+		image[i] = i % 2048 < 1536 ? rand() & 0xFF : i % 2048 < 1792 ? 0xFF
+				: i & 0x0F;
+
+	std::vector<BenchCommand> session =
+			replay ? load(replay) : generate(image, baud);
+
+	// the core's init() leaves the interrupts on
+	SREG.value = _BV(SREG_I);
+	setup();
+	_host_ready = _now;
+
+	std::vector<Bytes> answers;
+	double write_start = 0, write_end = 0, verify_start = 0, verify_end = 0;
+	size_t written = 0, verified = 0;
+	for (size_t i = 0; i < session.size(); i++)
+	{
+		uint8_t c = session[i].send[0];
+		double before = _host_ready;
+		answers.push_back(run(session[i]));
+
+		bool read;
+		size_t n = traffic(session[i], read);
+		if (n && !read)
+		{
+			if (!write_start)
+				write_start = before;
+			write_end = _host_ready - _latency;
+			written += n;
+		}
+		if (n && read)
+		{
+			if (!verify_start)
+				verify_start = before;
+			verify_end = _host_ready - _latency;
+			verified += n;
+		}
+
+		if (!session[i].expect.empty() && answers.back() != session[i].expect)
+		{
+			_mismatches++;
+			fprintf(stderr, "command %zu (0x%02X): answer differs\n", i, c);
+		}
+	}
+
+	if (record)
+		save(record, session, answers);
+
+	printf("session    %10.1f ms, %zu commands, host latency %.0f us\n",
+			_host_ready / 1000, session.size(), _latency);
+	if (write_end > write_start)
+		printf("write      %10.1f ms, %8.0f bytes/s\n",
+				(write_end - write_start) / 1000,
+				written * 1e6 / (write_end - write_start));
+	if (verify_end > verify_start)
+		printf("verify     %10.1f ms, %8.0f bytes/s\n",
+				(verify_end - verify_start) / 1000,
+				verified * 1e6 / (verify_end - verify_start));
+	printf("target     %10u pages written, %u violations\n", _target.pages,
+			_target.violations);
+	printf("line       %10u bytes overrun\n", _line.overruns);
+
+	if (!quiet)
+	{
+		printf("\ncommand      count    mean us     max us\n");
+		for (std::map<uint16_t, BenchStats>::iterator i =
+				_stats_by_cmd.begin(); i != _stats_by_cmd.end(); ++i)
+			printf("%s0x%02X %10u %10.1f %10.1f\n",
+					i->first & 0x100 ? "v2 " : "   ", i->first & 0xFF,
+					i->second.count, i->second.total / i->second.count,
+					i->second.max);
+	}
+
+	bool image_ok = replay || !memcmp(_target.flash, &image[0], size);
+	if (!image_ok)
+		printf("the target's flash differs from the image\n");
+	if (_mismatches)
+		printf("%u answers differ\n", _mismatches);
+
+	return _mismatches || _target.violations || _line.overruns || !image_ok;
+}
@@ -0,0 +1 @@
+// the Uno pins are in Arduino.h